@@ -9,213 +9,4963 @@
  */
 
 #include <bits/stdc++.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
 using namespace std;
 
+//----------- StringTable.h -----------
+// Interns names to dense 32-bit ids. Hot structures carry the id and the name
+// is looked up only for display. Ids are assigned in insertion order and never reused.
+class StringTable {
+    deque<string> names;                         // Stable storage backing the map keys
+    unordered_map<string_view, uint32_t> ids;
+public:
+    StringTable() = default;
+    StringTable(const StringTable &) = delete;   // Keys point into 'names'
+    StringTable &operator=(const StringTable &) = delete;
+
+    // Return the id for 's', adding it if new
+    uint32_t intern(string_view s) {
+        auto it = ids.find(s);
+        if (it != ids.end()) return it->second;
+        uint32_t id = uint32_t(names.size());
+        names.emplace_back(s);
+        ids.emplace(string_view(names.back()), id);
+        return id;
+    }
+
+    // Look up an existing id; false if 's' was never interned
+    bool find(string_view s, uint32_t &id) const {
+        auto it = ids.find(s);
+        if (it == ids.end()) return false;
+        id = it->second;
+        return true;
+    }
+
+    const string &name(uint32_t id) const { return names[id]; }
+    size_t size() const { return names.size(); }
+    void reserve(size_t n) { ids.reserve(n); }
+
+    // Approximate bytes held by names and the hash index
+    size_t bytesReserved() const {
+        size_t b = ids.bucket_count() * sizeof(void*)
+                 + ids.size() * (sizeof(string_view) + sizeof(uint32_t) + 2 * sizeof(void*));
+        for (auto &n : names) b += sizeof(string) + (n.capacity() > 15 ? n.capacity() + 1 : 0);
+        return b;
+    }
+};
+
 //----------- DemandRequest.h -----------
+// Nanoseconds on the monotonic clock; SystemClock's time base for request timestamps
+inline int64_t monotonicNanos() {
+    return chrono::duration_cast<chrono::nanoseconds>(
+        chrono::steady_clock::now().time_since_epoch()).count();
+}
+
 // Abstract base class representing a power demand request
 class DemandRequest {
 public:
-    string consumerID;      // Unique ID of the consumer
     double megawatts;       // Power requested in MW
-    time_t timestamp;       // Time when request was created
-    enum State { CREATED, QUEUED, ALLOCATED, SHED, COMPLETED } state;
+    int64_t timestamp;      // Arrival time, ns on the controller's clock at receiveDemand
+    uint32_t consumerID;    // Interned consumer id (GridController::consumerName resolves it)
+    enum State : uint8_t { CREATED, QUEUED, ALLOCATED, SHED, COMPLETED } state;
+    bool split = false;     // Allocated as shares across several substations
+    uint16_t region = 0;    // Transmission zone the demand is served from
+    uint8_t deferrals = 0;  // Ticks spent unplaced in the retry lane since last placed
+    uint8_t boost = 0;      // Priority levels gained by aging while deferred
+    uint64_t seq = 0;       // Global arrival sequence, the low bits of the queue key
+    uint32_t substation = kNoSubstation;  // Substation carrying the load (first share if split)
+    uint32_t loadPos = 0;   // Position in that substation's load list (first share id if split)
+    uint32_t consumerPrev = kNoSlot;  // Neighbours among the consumer's allocated requests
+    uint32_t consumerNext = kNoSlot;
+
+    static constexpr uint32_t kNoSubstation = UINT32_MAX;
+    static constexpr uint32_t kNoSlot = UINT32_MAX;
+
+    DemandRequest(uint32_t cid, double mw, int64_t ts)
+      : megawatts(mw), timestamp(ts), consumerID(cid), state(CREATED) {}
+
+    // Derived classes must define priority: higher means more critical
+    virtual int priority() const = 0;
+    virtual ~DemandRequest() {}
+};
+
+// Residential requests have lowest priority
+class ResidentialRequest : public DemandRequest {
+public:
+    ResidentialRequest(uint32_t c, double m, int64_t t): DemandRequest(c,m,t) {}
+    int priority() const override { return 1; }
+};
+// Commercial requests have medium priority
+class CommercialRequest : public DemandRequest {
+public:
+    CommercialRequest(uint32_t c, double m, int64_t t): DemandRequest(c,m,t) {}
+    int priority() const override { return 2; }
+};
+// Industrial requests have highest priority
+class IndustrialRequest : public DemandRequest {
+public:
+    IndustrialRequest(uint32_t c, double m, int64_t t): DemandRequest(c,m,t) {}
+    int priority() const override { return 3; }
+};
+
+//----------- RequestPool.h -----------
+// Fixed-slot pool that owns every DemandRequest. Slots live in chunks so addresses
+// stay stable as the pool grows, and released slots are recycled through a free
+// list, so steady-state intake does no heap allocation. Request subclasses only
+// override priority() and must not add data members, which keeps one slot size.
+class RequestPool {
+    struct Slot { alignas(DemandRequest) unsigned char bytes[sizeof(DemandRequest)]; };
+    static constexpr uint32_t kChunkShift = 12;
+    static constexpr uint32_t kChunkSlots = uint32_t(1) << kChunkShift;
+
+    vector<unique_ptr<Slot[]>> chunks;   // Slot storage, kChunkSlots per chunk
+    vector<uint32_t> freeSlots;          // Released slots ready for reuse
+    vector<bool> alive;                  // Whether each slot holds a constructed request
+    uint32_t highWater = 0;              // Slots ever handed out
+    size_t liveCount = 0;
+
+public:
+    RequestPool() = default;
+    RequestPool(const RequestPool &) = delete;
+    RequestPool &operator=(const RequestPool &) = delete;
+    ~RequestPool() {
+        for (uint32_t s = 0; s < highWater; ++s)
+            if (alive[s]) get(s)->~DemandRequest();
+    }
+
+    // Construct a request of type T in a free slot and return the slot index
+    template <class T, class... Args>
+    uint32_t create(Args&&... args) {
+        static_assert(is_base_of<DemandRequest, T>::value, "T must be a DemandRequest");
+        static_assert(sizeof(T) == sizeof(DemandRequest), "request types must not add members");
+        uint32_t s;
+        if (!freeSlots.empty()) {
+            s = freeSlots.back();
+            freeSlots.pop_back();
+        } else {
+            if ((highWater >> kChunkShift) == chunks.size())
+                chunks.emplace_back(new Slot[kChunkSlots]);
+            s = highWater++;
+            alive.push_back(false);
+        }
+        new (&chunks[s >> kChunkShift][s & (kChunkSlots - 1)]) T(forward<Args>(args)...);
+        alive[s] = true;
+        ++liveCount;
+        return s;
+    }
+
+    DemandRequest *get(uint32_t s) const {
+        return reinterpret_cast<DemandRequest*>(chunks[s >> kChunkShift][s & (kChunkSlots - 1)].bytes);
+    }
+
+    // Destroy the request in slot 's' and make the slot reusable
+    void release(uint32_t s) {
+        get(s)->~DemandRequest();
+        alive[s] = false;
+        freeSlots.push_back(s);
+        --liveCount;
+    }
+
+    size_t live() const { return liveCount; }
+    size_t freeCount() const { return freeSlots.size(); }
+
+    // Slots ever handed out; live ones are those below this with isLive() set
+    uint32_t slotLimit() const { return highWater; }
+    bool isLive(uint32_t s) const { return alive[s]; }
+
+    // Bytes held by slot chunks and bookkeeping (excludes out-of-line string storage)
+    size_t bytesReserved() const {
+        return chunks.size() * kChunkSlots * sizeof(Slot)
+             + chunks.capacity() * sizeof(unique_ptr<Slot[]>)
+             + freeSlots.capacity() * sizeof(uint32_t)
+             + alive.capacity() / 8;
+    }
+};
+
+//----------- DemandEntry.h -----------
+// Queue entry: a precomputed sort key stored inline next to a compact slot index,
+// so heap operations never touch the request object or call priority().
+// Key layout: priority class in the top 8 bits, inverted arrival sequence below,
+// so a larger key means higher priority and, within a class, an earlier arrival.
+struct DemandEntry {
+    uint64_t key;     // Packed priority/sequence key
+    uint32_t slot;    // Index of the request in GridController's request pool
+};
+
+constexpr int kDemandSeqBits = 56;
+constexpr uint64_t kDemandSeqMask = (uint64_t(1) << kDemandSeqBits) - 1;
+
+// Build the packed key for a request of priority 'prio' that arrived as number 'seq'
+inline uint64_t packDemandKey(int prio, uint64_t seq) {
+    uint64_t cls = uint64_t(min(max(prio, 0), 255));
+    return (cls << kDemandSeqBits) | (kDemandSeqMask - (seq & kDemandSeqMask));
+}
+
+// Priority class stored in a packed key
+inline int demandKeyPriority(uint64_t key) { return int(key >> kDemandSeqBits); }
+
+// Comparator for priority queue: a single integer compare on the packed key
+struct CompareDemand {
+    bool operator()(const DemandEntry &a, const DemandEntry &b) const {
+        return a.key < b.key;   // larger key (higher priority, older) first
+    }
+};
+
+//----------- DemandQueue.h -----------
+// Storage backend for pending demand entries; top() is always the next to dispatch
+class DemandQueue {
+public:
+    virtual ~DemandQueue() {}
+    virtual void push(const DemandEntry &e) = 0;
+    virtual const DemandEntry &top() const = 0;
+    virtual void pop() = 0;
+    virtual size_t size() const = 0;
+    bool empty() const { return size() == 0; }
+
+    // Visit every entry in dispatch order without modifying the queue
+    virtual void forEachOrdered(const function<void(const DemandEntry&)> &fn) const = 0;
+
+    // Append every entry to 'out' in no particular order and empty the queue
+    virtual void drainTo(vector<DemandEntry> &out) = 0;
+
+    // Append the first 'n' entries in dispatch order to 'out', touching only
+    // O(n) of the queue
+    virtual void topEntries(size_t n, vector<DemandEntry> &out) const = 0;
+
+    // Bytes reserved for queued entries
+    virtual size_t bytesReserved() const = 0;
+};
+
+// Binary max-heap over packed keys: O(log n) push/pop, any key order
+class HeapDemandQueue final : public DemandQueue {
+    vector<DemandEntry> heap;
+public:
+    void push(const DemandEntry &e) override {
+        heap.push_back(e);
+        push_heap(heap.begin(), heap.end(), CompareDemand());
+    }
+    const DemandEntry &top() const override { return heap.front(); }
+    void pop() override {
+        pop_heap(heap.begin(), heap.end(), CompareDemand());
+        heap.pop_back();
+    }
+    size_t size() const override { return heap.size(); }
+
+    void forEachOrdered(const function<void(const DemandEntry&)> &fn) const override {
+        vector<DemandEntry> sorted(heap);
+        sort(sorted.begin(), sorted.end(),
+             [](const DemandEntry &a, const DemandEntry &b) { return a.key > b.key; });
+        for (auto &e : sorted) fn(e);
+    }
+
+    void drainTo(vector<DemandEntry> &out) override {
+        out.insert(out.end(), heap.begin(), heap.end());
+        heap.clear();
+    }
+
+    // Best-first walk of the implicit tree: a node is only reached after its parent
+    void topEntries(size_t n, vector<DemandEntry> &out) const override {
+        auto later = [this](size_t a, size_t b) { return heap[a].key < heap[b].key; };
+        priority_queue<size_t, vector<size_t>, decltype(later)> frontier(later);
+        if (!heap.empty()) frontier.push(0);
+        for (size_t taken = 0; taken < n && !frontier.empty(); ++taken) {
+            size_t i = frontier.top();
+            frontier.pop();
+            out.push_back(heap[i]);
+            if (2 * i + 1 < heap.size()) frontier.push(2 * i + 1);
+            if (2 * i + 2 < heap.size()) frontier.push(2 * i + 2);
+        }
+    }
+
+    size_t bytesReserved() const override { return heap.capacity() * sizeof(DemandEntry); }
+};
+
+// Growable power-of-two ring buffer of entries (FIFO)
+class DemandRing {
+    vector<DemandEntry> buf;
+    size_t head = 0, count = 0;
+public:
+    void push_back(const DemandEntry &e) {
+        if (count == buf.size()) {
+            // Unroll into a buffer twice the size
+            vector<DemandEntry> grown(max<size_t>(16, 2 * buf.size()));
+            for (size_t i = 0; i < count; ++i) grown[i] = at(i);
+            buf.swap(grown);
+            head = 0;
+        }
+        buf[(head + count++) & (buf.size() - 1)] = e;
+    }
+    const DemandEntry &front() const { return buf[head]; }
+    void pop_front() { head = (head + 1) & (buf.size() - 1); --count; }
+    const DemandEntry &at(size_t i) const { return buf[(head + i) & (buf.size() - 1)]; }
+    size_t size() const { return count; }
+    size_t capacity() const { return buf.size(); }
+    void clear() { head = count = 0; }
+};
+
+// One FIFO ring per priority class, drained highest class first: O(1) push/pop.
+// Within a class entries leave in push order, which is arrival order because
+// the intake enqueues records strictly by arrival sequence, holding any that
+// arrive ahead of a gap. Rings are created on first use, so any priority in
+// 0..255 can be added without touching the queue.
+class BucketDemandQueue final : public DemandQueue {
+    vector<DemandRing> rings;   // Indexed by priority class
+    size_t total = 0;
+    size_t highest = 0;         // Highest class that may be non-empty
+public:
+    void push(const DemandEntry &e) override {
+        size_t cls = size_t(demandKeyPriority(e.key));
+        if (cls >= rings.size()) rings.resize(cls + 1);
+        rings[cls].push_back(e);
+        highest = max(highest, cls);
+        ++total;
+    }
+    const DemandEntry &top() const override { return rings[highest].front(); }
+    void pop() override {
+        rings[highest].pop_front();
+        if (--total == 0) { highest = 0; return; }
+        while (rings[highest].size() == 0) --highest;
+    }
+    size_t size() const override { return total; }
+
+    void forEachOrdered(const function<void(const DemandEntry&)> &fn) const override {
+        for (size_t c = rings.size(); c-- > 0; )
+            for (size_t i = 0; i < rings[c].size(); ++i) fn(rings[c].at(i));
+    }
+
+    void drainTo(vector<DemandEntry> &out) override {
+        for (auto &r : rings) {
+            for (size_t i = 0; i < r.size(); ++i) out.push_back(r.at(i));
+            r.clear();
+        }
+        total = highest = 0;
+    }
+
+    void topEntries(size_t n, vector<DemandEntry> &out) const override {
+        for (size_t c = rings.size(); c-- > 0 && n > 0; )
+            for (size_t i = 0; i < rings[c].size() && n > 0; ++i, --n)
+                out.push_back(rings[c].at(i));
+    }
+
+    size_t bytesReserved() const override {
+        size_t b = rings.capacity() * sizeof(DemandRing);
+        for (auto &r : rings) b += r.capacity() * sizeof(DemandEntry);
+        return b;
+    }
+};
+
+// Which DemandQueue implementation a controller uses
+enum class QueueBackend { HEAP, BUCKET };
+
+inline unique_ptr<DemandQueue> makeDemandQueue(QueueBackend backend) {
+    if (backend == QueueBackend::BUCKET)
+        return unique_ptr<DemandQueue>(new BucketDemandQueue());
+    return unique_ptr<DemandQueue>(new HeapDemandQueue());
+}
+
+//----------- Substation.h -----------
+// Represents a power substation with capacity
+class Substation {
+public:
+    uint32_t id;          // Interned substation id (equals its index in the grid)
+    double capacityMW;    // Maximum capacity in MW
+    double usedMW = 0;    // Currently allocated MW
+    bool online = true;   // Whether the substation is operational
+    int maintenanceHolds = 0;  // Number of maintenance jobs currently in progress
+    uint16_t region = 0;       // Transmission zone
+    uint32_t regionPos = 0;    // Position within its region's capacity index
+    vector<uint32_t> loads;    // Request slots allocated here; kShareTag marks a split share id
+
+    Substation(uint32_t i, double cap): id(i), capacityMW(cap) {}
+
+    // Returns available capacity if online, else zero
+    double available() const { return online ? capacityMW - usedMW : 0; }
+
+    // Try allocate 'mw'; return true if successful
+    bool allocate(double mw) {
+        if (available() >= mw) {
+            usedMW += mw;
+            return true;
+        }
+        return false;
+    }
+
+    // Deallocate 'mw' from used capacity, never going below zero
+    void deallocate(double mw) { usedMW = max(0.0, usedMW - mw); }
+};
+
+//----------- GridTopology.h -----------
+// The static part of a grid: what addSubstation() was given, in id order.
+// Scenario runs share one read-only copy instead of rebuilding it per scenario.
+struct GridTopology {
+    vector<string> ids;
+    vector<double> capacityMW;      // Transformer rating
+    vector<uint16_t> zone;
+    vector<double> feederLimitMW;   // Most the feeders can carry; HUGE_VAL = no limit
+
+    size_t size() const { return ids.size(); }
+};
+
+//----------- MaintenanceJob.h -----------
+// Represents a scheduled maintenance for a substation
+class MaintenanceJob {
+public:
+    uint32_t substationID;  // Interned substation id, resolved when scheduled
+    time_t startTime;
+    time_t endTime;
+    enum State { SCHEDULED, IN_PROGRESS, DONE } state;
+
+    MaintenanceJob(uint32_t sid, time_t st, time_t et)
+      : substationID(sid), startTime(st), endTime(et), state(SCHEDULED) {}
+
+    // Advance job state based on current time
+    void advanceState(time_t now) {
+        if (state == SCHEDULED && now >= startTime)
+            state = IN_PROGRESS;
+        if (state == IN_PROGRESS && now >= endTime)
+            state = DONE;
+    }
+};
+
+// A start or end edge of a maintenance window, ordered by time in the event queue
+struct MaintenanceEvent {
+    time_t at;         // When the edge fires
+    size_t jobID;      // Key into GridController's active job table
+    bool start;        // true = window opens, false = window closes
+};
+
+// Comparator for the event min-heap: earliest first, starts before ends at equal times
+struct CompareEvent {
+    bool operator()(const MaintenanceEvent &a, const MaintenanceEvent &b) const {
+        if (a.at != b.at)
+            return a.at > b.at;
+        return !a.start && b.start;
+    }
+};
+
+//----------- CapacityIndex.h -----------
+// Substation selection policy for a demand
+enum class AllocPolicy {
+    FIRST_FIT,   // lowest-index substation that fits (original behaviour)
+    BEST_FIT,    // substation with the least available MW that still fits
+    WORST_FIT,   // substation with the most available MW
+    SCAN_FIRST,  // first fit by brute-force vector scan of the CapacityStore
+    SCAN_BEST    // best fit by brute-force vector scan of the CapacityStore
+};
+
+// Index over per-substation available MW, updated in place on every capacity change.
+// A max segment tree answers first-fit and worst-fit; an ordered multimap answers
+// best-fit. Offline substations are excluded from both. All queries are O(log n).
+class CapacityIndex {
+    size_t count = 0;                   // Number of indexed substations
+    size_t leaves = 1;                  // Segment tree width (power of two >= count)
+    vector<double> tree;                // Max of available MW per subtree; -1 = offline/empty
+    multimap<double, size_t> byAvail;   // Online substations ordered by available MW
+    vector<multimap<double, size_t>::iterator> handles;  // Per-substation node in byAvail
+
+    void setLeaf(size_t i, double v) {
+        size_t p = leaves + i;
+        tree[p] = v;
+        for (p >>= 1; p >= 1; p >>= 1)
+            tree[p] = max(tree[2 * p], tree[2 * p + 1]);
+    }
+
+public:
+    static constexpr size_t npos = SIZE_MAX;
+
+    CapacityIndex() : tree(2, -1.0) {}
+
+    // Append many online substations at once: the tree is resized once and its
+    // internal nodes rebuilt bottom-up in one pass
+    void append(const vector<double> &avail) {
+        size_t width = leaves;
+        while (width < count + avail.size()) width *= 2;
+        if (width != leaves) {
+            vector<double> grown(2 * width, -1.0);
+            copy(tree.begin() + leaves, tree.begin() + leaves + count, grown.begin() + width);
+            leaves = width;
+            tree.swap(grown);
+        }
+        // Insert into byAvail in key order so each node goes in at the hint
+        size_t base = count;
+        vector<size_t> order(avail.size());
+        iota(order.begin(), order.end(), size_t(0));
+        stable_sort(order.begin(), order.end(), [&](size_t x, size_t y) { return avail[x] < avail[y]; });
+        handles.resize(base + avail.size());
+        auto hint = byAvail.end();
+        if (!order.empty()) hint = byAvail.upper_bound(avail[order[0]]);
+        for (size_t k : order) {
+            handles[base + k] = byAvail.emplace_hint(hint, avail[k], base + k);
+            hint = next(handles[base + k]);
+        }
+        for (size_t k = 0; k < avail.size(); ++k)
+            tree[leaves + base + k] = avail[k];
+        count += avail.size();
+        for (size_t p = leaves - 1; p >= 1; --p)
+            tree[p] = max(tree[2 * p], tree[2 * p + 1]);
+    }
+
+    size_t size() const { return count; }
+
+    // Append a substation with the given availability
+    void push(double avail, bool online) {
+        if (count == leaves) {
+            // Double the tree width and rebuild internal nodes
+            vector<double> grown(4 * leaves, -1.0);
+            copy(tree.begin() + leaves, tree.begin() + leaves + count, grown.begin() + 2 * leaves);
+            leaves *= 2;
+            tree.swap(grown);
+            for (size_t p = leaves - 1; p >= 1; --p)
+                tree[p] = max(tree[2 * p], tree[2 * p + 1]);
+        }
+        handles.push_back(byAvail.end());
+        ++count;
+        update(count - 1, avail, online);
+    }
+
+    // Re-key substation 'i' after its availability or online state changed
+    void update(size_t i, double avail, bool online) {
+        auto &h = handles[i];
+        if (!online) {
+            if (h != byAvail.end()) {
+                byAvail.erase(h);
+                h = byAvail.end();
+            }
+            setLeaf(i, -1.0);
+            return;
+        }
+        if (h == byAvail.end()) {
+            h = byAvail.emplace(avail, i);
+        } else if (h->first != avail) {
+            // Reuse the node rather than reallocating it
+            auto node = byAvail.extract(h);
+            node.key() = avail;
+            h = byAvail.insert(move(node));
+        }
+        setLeaf(i, avail);
+    }
+
+    // Visit online substations from most to least available until fn returns false
+    template <class F>
+    void forEachDescending(F fn) const {
+        for (auto it = byAvail.rbegin(); it != byAvail.rend(); ++it)
+            if (!fn(it->second, it->first)) return;
+    }
+
+    // Pick a substation able to take 'mw' under policy P, fixed at compile time;
+    // npos if none fits. Any non-index policy falls back to first fit.
+    template <AllocPolicy P>
+    size_t select(double mw) const {
+        if (count == 0 || tree[1] < mw)
+            return npos;
+        if constexpr (P == AllocPolicy::BEST_FIT) {
+            return byAvail.lower_bound(mw)->second;
+        } else if constexpr (P == AllocPolicy::WORST_FIT) {
+            return prev(byAvail.end())->second;
+        } else {
+            // Descend toward the leftmost leaf whose value fits
+            size_t p = 1;
+            while (p < leaves)
+                p = (tree[2 * p] >= mw) ? 2 * p : 2 * p + 1;
+            return p - leaves;
+        }
+    }
+
+    // Same, with the policy chosen at run time
+    size_t select(double mw, AllocPolicy policy) const {
+        switch (policy) {
+        case AllocPolicy::BEST_FIT: return select<AllocPolicy::BEST_FIT>(mw);
+        case AllocPolicy::WORST_FIT: return select<AllocPolicy::WORST_FIT>(mw);
+        default: return select<AllocPolicy::FIRST_FIT>(mw);
+        }
+    }
+};
+
+// Parse a policy name ("first", "best", "worst", "scan-first", "scan-best");
+// returns false if unknown
+inline bool parseAllocPolicy(const string &name, AllocPolicy &out) {
+    if (name == "first") out = AllocPolicy::FIRST_FIT;
+    else if (name == "best") out = AllocPolicy::BEST_FIT;
+    else if (name == "worst") out = AllocPolicy::WORST_FIT;
+    else if (name == "scan-first") out = AllocPolicy::SCAN_FIRST;
+    else if (name == "scan-best") out = AllocPolicy::SCAN_BEST;
+    else return false;
+    return true;
+}
+
+//----------- CapacityStore.h -----------
+// Brute-force capacity scans over contiguous arrays. Each kernel takes capacity
+// and used MW plus an online bitset for 'n' positions (n a multiple of 8) and
+// returns the position picked for 'mw', or SIZE_MAX if none fits. Best-fit ties
+// go to the lowest position.
+using CapacityScanFn = size_t (*)(const double *cap, const double *used,
+                                  const uint64_t *online, size_t n, double mw);
+
+inline size_t scanFirstFitScalar(const double *cap, const double *used,
+                                 const uint64_t *online, size_t n, double mw) {
+    for (size_t i = 0; i < n; ++i)
+        if ((online[i >> 6] >> (i & 63) & 1) && cap[i] - used[i] >= mw)
+            return i;
+    return SIZE_MAX;
+}
+
+inline size_t scanBestFitScalar(const double *cap, const double *used,
+                                const uint64_t *online, size_t n, double mw) {
+    size_t best = SIZE_MAX;
+    double bestAvail = HUGE_VAL;
+    for (size_t i = 0; i < n; ++i) {
+        double avail = cap[i] - used[i];
+        if ((online[i >> 6] >> (i & 63) & 1) && avail >= mw && avail < bestAvail) {
+            bestAvail = avail;
+            best = i;
+        }
+    }
+    return best;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// Eight positions per iteration; the online bits for them are one byte of the bitset
+__attribute__((target("avx2")))
+inline size_t scanFirstFitAvx2(const double *cap, const double *used,
+                               const uint64_t *online, size_t n, double mw) {
+    const __m256d need = _mm256_set1_pd(mw);
+    for (size_t i = 0; i < n; i += 8) {
+        unsigned up = unsigned(online[i >> 6] >> (i & 63)) & 0xFF;
+        if (!up) continue;
+        __m256d lo = _mm256_sub_pd(_mm256_loadu_pd(cap + i), _mm256_loadu_pd(used + i));
+        __m256d hi = _mm256_sub_pd(_mm256_loadu_pd(cap + i + 4), _mm256_loadu_pd(used + i + 4));
+        unsigned fit = unsigned(_mm256_movemask_pd(_mm256_cmp_pd(lo, need, _CMP_GE_OQ)))
+                     | unsigned(_mm256_movemask_pd(_mm256_cmp_pd(hi, need, _CMP_GE_OQ))) << 4;
+        fit &= up;
+        if (fit)
+            return i + size_t(__builtin_ctz(fit));
+    }
+    return SIZE_MAX;
+}
+
+// Per-lane running minimum of fitting availability and its position (held as a
+// double, exact below 2^53), reduced across lanes at the end
+__attribute__((target("avx2")))
+inline size_t scanBestFitAvx2(const double *cap, const double *used,
+                              const uint64_t *online, size_t n, double mw) {
+    const __m256d need = _mm256_set1_pd(mw);
+    const __m256d none = _mm256_set1_pd(HUGE_VAL);
+    const __m256i laneBit = _mm256_setr_epi64x(1, 2, 4, 8);
+    __m256d best = none;
+    __m256d bestPos = _mm256_setzero_pd();
+    __m256d pos = _mm256_setr_pd(0, 1, 2, 3);
+    const __m256d step = _mm256_set1_pd(4);
+    for (size_t i = 0; i < n; i += 4, pos = _mm256_add_pd(pos, step)) {
+        long long up = (long long)(online[i >> 6] >> (i & 63) & 0xF);
+        if (!up) continue;
+        __m256d upMask = _mm256_castsi256_pd(_mm256_cmpeq_epi64(
+            _mm256_and_si256(_mm256_set1_epi64x(up), laneBit), laneBit));
+        __m256d avail = _mm256_sub_pd(_mm256_loadu_pd(cap + i), _mm256_loadu_pd(used + i));
+        __m256d fit = _mm256_and_pd(upMask, _mm256_cmp_pd(avail, need, _CMP_GE_OQ));
+        __m256d better = _mm256_and_pd(fit, _mm256_cmp_pd(avail, best, _CMP_LT_OQ));
+        best = _mm256_blendv_pd(best, avail, better);
+        bestPos = _mm256_blendv_pd(bestPos, pos, better);
+    }
+    alignas(32) double v[4], p[4];
+    _mm256_store_pd(v, best);
+    _mm256_store_pd(p, bestPos);
+    size_t lane = 0;
+    for (size_t k = 1; k < 4; ++k)
+        if (v[k] < v[lane] || (v[k] == v[lane] && p[k] < p[lane]))
+            lane = k;
+    return v[lane] == HUGE_VAL ? SIZE_MAX : size_t(p[lane]);
+}
+#endif
+
+#if defined(__aarch64__)
+inline size_t scanFirstFitNeon(const double *cap, const double *used,
+                               const uint64_t *online, size_t n, double mw) {
+    const float64x2_t need = vdupq_n_f64(mw);
+    for (size_t i = 0; i < n; i += 2) {
+        unsigned up = unsigned(online[i >> 6] >> (i & 63)) & 0x3;
+        if (!up) continue;
+        uint64x2_t ge = vcgeq_f64(vsubq_f64(vld1q_f64(cap + i), vld1q_f64(used + i)), need);
+        unsigned fit = (unsigned(vgetq_lane_u64(ge, 0)) & 1) | (unsigned(vgetq_lane_u64(ge, 1)) & 2);
+        fit &= up;
+        if (fit)
+            return i + size_t(__builtin_ctz(fit));
+    }
+    return SIZE_MAX;
+}
+
+inline size_t scanBestFitNeon(const double *cap, const double *used,
+                              const uint64_t *online, size_t n, double mw) {
+    const float64x2_t need = vdupq_n_f64(mw);
+    const uint64x2_t laneBit = {1, 2};
+    float64x2_t best = vdupq_n_f64(HUGE_VAL);
+    float64x2_t bestPos = vdupq_n_f64(0);
+    float64x2_t pos = {0, 1};
+    const float64x2_t step = vdupq_n_f64(2);
+    for (size_t i = 0; i < n; i += 2, pos = vaddq_f64(pos, step)) {
+        uint64_t up = online[i >> 6] >> (i & 63) & 0x3;
+        if (!up) continue;
+        uint64x2_t upMask = vceqq_u64(vandq_u64(vdupq_n_u64(up), laneBit), laneBit);
+        float64x2_t avail = vsubq_f64(vld1q_f64(cap + i), vld1q_f64(used + i));
+        uint64x2_t better = vandq_u64(vandq_u64(upMask, vcgeq_f64(avail, need)),
+                                      vcltq_f64(avail, best));
+        best = vbslq_f64(better, avail, best);
+        bestPos = vbslq_f64(better, pos, bestPos);
+    }
+    double v0 = vgetq_lane_f64(best, 0), v1 = vgetq_lane_f64(best, 1);
+    double p0 = vgetq_lane_f64(bestPos, 0), p1 = vgetq_lane_f64(bestPos, 1);
+    if (v1 < v0 || (v1 == v0 && p1 < p0)) { v0 = v1; p0 = p1; }
+    return v0 == HUGE_VAL ? SIZE_MAX : size_t(p0);
+}
+#endif
+
+// Scan kernels for this CPU, chosen once: AVX2 when the processor supports it,
+// NEON on AArch64, otherwise scalar
+struct CapacityScanKernels {
+    CapacityScanFn firstFit;
+    CapacityScanFn bestFit;
+    const char *name;
+};
+
+inline const CapacityScanKernels &capacityScanKernels() {
+    static const CapacityScanKernels kernels = [] {
+#if defined(__x86_64__) || defined(__i386__)
+        if (__builtin_cpu_supports("avx2"))
+            return CapacityScanKernels{scanFirstFitAvx2, scanBestFitAvx2, "avx2"};
+#elif defined(__aarch64__)
+        return CapacityScanKernels{scanFirstFitNeon, scanBestFitNeon, "neon"};
+#endif
+        return CapacityScanKernels{scanFirstFitScalar, scanBestFitScalar, "scalar"};
+    }();
+    return kernels;
+}
+
+// Structure-of-arrays mirror of a region's substation capacity, by local position.
+// Arrays grow in blocks of 8 whose unused tail is offline, so kernels never need
+// a remainder loop.
+class CapacityStore {
+    static constexpr size_t kBlock = 8;
+    size_t count = 0;
+    vector<double> capacityMW;   // Per position
+    vector<double> usedMW;       // Per position
+    vector<uint64_t> online;     // Bit i set when position i is online
+
+public:
+    static constexpr size_t npos = SIZE_MAX;
+
+    // Make room for 'n' positions in total
+    void reserve(size_t n) {
+        size_t padded = (n + kBlock - 1) / kBlock * kBlock;
+        capacityMW.reserve(padded);
+        usedMW.reserve(padded);
+        online.reserve((padded + 63) / 64);
+    }
+
+    // Append a substation
+    void push(double cap, double used, bool up) {
+        if (count == capacityMW.size()) {
+            capacityMW.resize(count + kBlock, 0.0);
+            usedMW.resize(count + kBlock, 0.0);
+            online.resize((count + kBlock + 63) / 64, 0);
+        }
+        update(count++, cap, used, up);
+    }
+
+    // Overwrite position 'i' after its load or online state changed
+    void update(size_t i, double cap, double used, bool up) {
+        capacityMW[i] = cap;
+        usedMW[i] = used;
+        uint64_t bit = uint64_t(1) << (i & 63);
+        online[i >> 6] = up ? online[i >> 6] | bit : online[i >> 6] & ~bit;
+    }
+
+    // Pick a position able to take 'mw': lowest index or least available; npos if none fits
+    size_t select(double mw, AllocPolicy policy) const {
+        const CapacityScanKernels &k = capacityScanKernels();
+        CapacityScanFn fn = policy == AllocPolicy::SCAN_BEST ? k.bestFit : k.firstFit;
+        return fn(capacityMW.data(), usedMW.data(), online.data(), capacityMW.size(), mw);
+    }
+
+    // Same for a policy fixed at compile time. Builds that target AVX2
+    // (-mavx2, -march=native) or AArch64 call that kernel directly; others keep
+    // the run-time choice so a generic x86 binary still uses AVX2 when present.
+    template <AllocPolicy P>
+    size_t select(double mw) const {
+        const double *c = capacityMW.data(), *u = usedMW.data();
+        const uint64_t *up = online.data();
+        size_t n = capacityMW.size();
+        constexpr bool best = P == AllocPolicy::SCAN_BEST;
+#if defined(__AVX2__)
+        return best ? scanBestFitAvx2(c, u, up, n, mw) : scanFirstFitAvx2(c, u, up, n, mw);
+#elif defined(__aarch64__)
+        return best ? scanBestFitNeon(c, u, up, n, mw) : scanFirstFitNeon(c, u, up, n, mw);
+#else
+        const CapacityScanKernels &k = capacityScanKernels();
+        return (best ? k.bestFit : k.firstFit)(c, u, up, n, mw);
+#endif
+    }
+
+    size_t bytesReserved() const {
+        return (capacityMW.capacity() + usedMW.capacity()) * sizeof(double)
+             + online.capacity() * sizeof(uint64_t);
+    }
+};
+
+//----------- ThreadPool.h -----------
+// Fixed set of worker threads running index-parallel loops. The calling thread
+// takes part in each loop, so a pool of N workers gives N + 1 lanes.
+class ThreadPool {
+    vector<thread> workers;
+    mutex mtx;
+    condition_variable wake, done;
+    const function<void(size_t)> *task = nullptr;
+    size_t taskCount = 0;
+    atomic<size_t> next{0};
+    size_t busy = 0;             // Workers still running the current loop
+    uint64_t generation = 0;     // Bumped once per parallelFor
+    bool stopping = false;
+
+    void drain() {
+        for (size_t i; (i = next.fetch_add(1, memory_order_relaxed)) < taskCount; )
+            (*task)(i);
+    }
+
+    void workerLoop() {
+        uint64_t seen = 0;
+        unique_lock<mutex> lk(mtx);
+        while (true) {
+            wake.wait(lk, [&] { return stopping || generation != seen; });
+            if (stopping) return;
+            seen = generation;
+            lk.unlock();
+            drain();
+            lk.lock();
+            if (--busy == 0) done.notify_one();
+        }
+    }
+
+public:
+    explicit ThreadPool(size_t threads) {
+        for (size_t i = 0; i < threads; ++i)
+            workers.emplace_back([this] { workerLoop(); });
+    }
+    ~ThreadPool() {
+        {
+            lock_guard<mutex> lk(mtx);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (auto &w : workers) w.join();
+    }
+
+    // Run fn(i) for every i in [0, n) and return once all calls finished
+    void parallelFor(size_t n, const function<void(size_t)> &fn) {
+        if (workers.empty() || n <= 1) {
+            for (size_t i = 0; i < n; ++i) fn(i);
+            return;
+        }
+        {
+            lock_guard<mutex> lk(mtx);
+            task = &fn;
+            taskCount = n;
+            next.store(0, memory_order_relaxed);
+            busy = workers.size();
+            ++generation;
+        }
+        wake.notify_all();
+        drain();
+        unique_lock<mutex> lk(mtx);
+        done.wait(lk, [&] { return busy == 0; });
+        task = nullptr;
+    }
+
+    size_t lanes() const { return workers.size() + 1; }
+};
+
+//----------- IntakeRing.h -----------
+// A demand accepted by receiveDemand but not yet queued. 'make' constructs the
+// concrete request type in the pool when the scheduler drains the intake.
+struct IntakeRecord {
+    double megawatts;
+    int64_t timestamp;      // ns on the controller clock at arrival
+    uint64_t seq;           // Global arrival sequence, taken before the ring push
+    uint32_t consumer;
+    uint16_t zone;
+    uint32_t (*make)(RequestPool &pool, uint32_t consumer, double mw, int64_t ts);
+};
+
+template <class T>
+uint32_t makePooledRequest(RequestPool &pool, uint32_t consumer, double mw, int64_t ts) {
+    return pool.create<T>(consumer, mw, ts);
+}
+
+// Bounded lock-free multi-producer / single-consumer ring (Vyukov's sequence-
+// numbered cells). Producers claim a cell with one CAS on 'tail'; the consumer
+// owns 'head'. push() fails instead of waiting when the ring is full.
+class IntakeRing {
+    struct Cell {
+        atomic<size_t> seq;
+        IntakeRecord rec;
+    };
+    unique_ptr<Cell[]> cells;
+    size_t mask;
+    alignas(64) atomic<size_t> tail{0};   // Next cell producers claim
+    alignas(64) size_t head = 0;          // Next cell the consumer reads
+
+public:
+    explicit IntakeRing(size_t capacityPow2) : cells(new Cell[capacityPow2]), mask(capacityPow2 - 1) {
+        for (size_t i = 0; i < capacityPow2; ++i)
+            cells[i].seq.store(i, memory_order_relaxed);
+    }
+
+    // Any thread. Returns false if the ring is full.
+    bool push(const IntakeRecord &r) {
+        size_t pos = tail.load(memory_order_relaxed);
+        while (true) {
+            Cell &c = cells[pos & mask];
+            size_t seq = c.seq.load(memory_order_acquire);
+            intptr_t diff = intptr_t(seq) - intptr_t(pos);
+            if (diff == 0) {
+                if (tail.compare_exchange_weak(pos, pos + 1, memory_order_relaxed)) {
+                    c.rec = r;
+                    c.seq.store(pos + 1, memory_order_release);
+                    return true;
+                }
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = tail.load(memory_order_relaxed);
+            }
+        }
+    }
+
+    // Any thread. Claim 'n' consecutive cells with one CAS and fill them in
+    // order; returns false, claiming nothing, unless all of them are free.
+    bool pushBatch(const IntakeRecord *r, size_t n) {
+        if (n == 0) return true;
+        if (n > mask + 1) return false;
+        size_t pos = tail.load(memory_order_relaxed);
+        while (true) {
+            // The consumer frees cells in order, so if the last is free all are
+            Cell &last = cells[(pos + n - 1) & mask];
+            size_t seq = last.seq.load(memory_order_acquire);
+            intptr_t diff = intptr_t(seq) - intptr_t(pos + n - 1);
+            if (diff == 0) {
+                if (tail.compare_exchange_weak(pos, pos + n, memory_order_relaxed)) {
+                    for (size_t i = 0; i < n; ++i) {
+                        Cell &c = cells[(pos + i) & mask];
+                        c.rec = r[i];
+                        c.seq.store(pos + i + 1, memory_order_release);
+                    }
+                    return true;
+                }
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = tail.load(memory_order_relaxed);
+            }
+        }
+    }
+
+    // Consumer thread only. Returns false if no published record is ready.
+    bool pop(IntakeRecord &r) {
+        Cell &c = cells[head & mask];
+        if (c.seq.load(memory_order_acquire) != head + 1)
+            return false;
+        r = c.rec;
+        c.seq.store(head + mask + 1, memory_order_release);
+        ++head;
+        return true;
+    }
+
+    // Records pushed but not yet popped (approximate while producers run)
+    size_t approxSize() const { return tail.load(memory_order_relaxed) - head; }
+    size_t bytesReserved() const { return (mask + 1) * sizeof(Cell); }
+};
+
+//----------- GridClock.h -----------
+// Where the controller reads time: wall-clock seconds for maintenance windows
+// and ticks, monotonic nanoseconds for demand timestamps. Each controller has
+// its own, so simulations on separate controllers can run side by side.
+class GridClock {
+public:
+    virtual ~GridClock() = default;
+    virtual time_t wallTime() const = 0;
+    virtual int64_t monotonic() const = 0;
+};
+
+// The real clocks; the default for every controller
+class SystemClock : public GridClock {
+public:
+    time_t wallTime() const override { return time(nullptr); }
+    int64_t monotonic() const override { return monotonicNanos(); }
+
+    static const SystemClock &instance() {
+        static const SystemClock clock;
+        return clock;
+    }
+};
+
+// Time that only moves when told to. The monotonic reading is the wall time in
+// nanoseconds, so demand timestamps line up with the simulated schedule.
+class VirtualClock : public GridClock {
+    atomic<int64_t> nanos;
+public:
+    explicit VirtualClock(time_t start = 0) : nanos(int64_t(start) * 1000000000) {}
+
+    time_t wallTime() const override { return time_t(nanos.load(memory_order_relaxed) / 1000000000); }
+    int64_t monotonic() const override { return nanos.load(memory_order_relaxed); }
+
+    void set(time_t t) { nanos.store(int64_t(t) * 1000000000, memory_order_relaxed); }
+    void advance(int64_t ns) { nanos.fetch_add(ns, memory_order_relaxed); }
+};
+
+//----------- GridController.h -----------
+// How much state a balance tick re-evaluates
+enum class BalanceMode {
+    INCREMENTAL,   // Only deltas: new demands, plus migrating load off substations that went offline
+    FULL           // Release every allocation and re-place all live demands from scratch
+};
+
+// What changed between two ticks; filled in by runScheduler
+struct TickDelta {
+    size_t newDemands = 0;     // Drained from the intake this tick
+    size_t wentOffline = 0;    // Substations whose first maintenance hold started
+    size_t cameOnline = 0;     // Substations whose last maintenance hold ended
+    size_t requeued = 0;       // Allocated demands re-placed this tick
+    size_t released = 0;       // Demands completed through release since the previous tick
+    size_t migrated = 0;       // Allocations moved off substations entering maintenance
+    double migratedMW = 0;
+    size_t migrationShed = 0;  // Allocations dropped because no substation could take them
+    double migrationShedMW = 0;
+    size_t placed = 0;         // Queued demands allocated this tick
+    size_t shed = 0;           // Queued demands shed this tick
+    double shedMW = 0;
+    size_t deferred = 0;       // Unplaced demands kept for another tick under the retry horizon
+    double deferredMW = 0;
+};
+
+//----------- Metrics.h -----------
+// Phases of a balance tick, in execution order
+enum class TickPhase { INTAKE, MAINTENANCE, REQUEUE, ALLOCATE, OVERFLOW, COUNT };
+
+inline const char *tickPhaseName(TickPhase p) {
+    static const char *const names[] = {"intake", "maintenance", "requeue", "allocate", "overflow"};
+    return names[size_t(p)];
+}
+
+// Cumulative scheduler counters and phase timings. Only the scheduler thread
+// writes them, once per tick or drain, so relaxed atomics cost a handful of
+// uncontended adds per tick; any thread may read them.
+struct SchedulerMetrics {
+    static constexpr size_t kPhases = size_t(TickPhase::COUNT);
+
+    atomic<uint64_t> ticks{0};
+    atomic<uint64_t> received{0};        // Demands taken from intake
+    atomic<uint64_t> spilled{0};         // ...of which arrived while the ring was full
+    atomic<uint64_t> placed{0};
+    atomic<uint64_t> shed{0};
+    atomic<double> shedMW{0};
+    atomic<uint64_t> deferred{0};        // Unplaced demands held for a retry
+    atomic<uint64_t> requeued{0};        // Re-placed by full ticks
+    atomic<uint64_t> migrated{0};        // Moved off substations entering maintenance
+    atomic<uint64_t> migrationShed{0};
+    atomic<uint64_t> released{0};
+    atomic<uint64_t> phaseNanos[kPhases] = {};      // Total time per phase
+    atomic<uint64_t> lastPhaseNanos[kPhases] = {};  // Same, for the latest tick
+
+    static void add(atomic<uint64_t> &c, uint64_t n) { c.fetch_add(n, memory_order_relaxed); }
+    static void add(atomic<double> &c, double v) {
+        c.store(c.load(memory_order_relaxed) + v, memory_order_relaxed);   // Single writer
+    }
+    static uint64_t get(const atomic<uint64_t> &c) { return c.load(memory_order_relaxed); }
+};
+
+// One substation's part of a split allocation
+struct LoadShare {
+    double mw;
+    uint32_t slot;         // Request the share belongs to
+    uint32_t substation;   // Substation carrying this part
+    uint32_t loadPos;      // Position in that substation's load list
+    uint32_t next;         // Next share of the same request, or kNoShare
+};
+
+constexpr uint32_t kNoShare = UINT32_MAX;
+constexpr uint32_t kShareTag = uint32_t(1) << 31;   // Load-list entry refers to a share id
+
+// Per-zone scheduling state. Each region balances its own queue against its own
+// substations, so regions can run concurrently within a tick. Split shares live
+// in the region that owns their substations, for the same reason.
+struct Region {
+    unique_ptr<DemandQueue> queue;     // Pending demands tagged with this region
+    CapacityIndex index;               // Over this region's substations, by local position
+    CapacityStore store;               // Same positions, flat arrays for the scan policies
+    vector<uint32_t> subs;             // Global substation index for each local position
+    vector<DemandEntry> overflow;      // Entries this region could not place this tick
+    vector<DemandEntry> deferred;      // Retry lane: unplaced entries under aged keys, key descending
+    vector<uint32_t> placed;           // Slots allocated here this phase, consumer-linked afterwards
+    vector<LoadShare> shares;          // Split-allocation shares on this region's substations
+    vector<uint32_t> freeShares;       // Recycled share ids
+    vector<pair<size_t, double>> splitPlan;   // Scratch: (local position, MW) per share
+    vector<pair<double, DemandEntry>> batch;  // Scratch: (MW, entry) for batch packing
+};
+
+// Queued demands of one priority class
+struct ClassTotals {
+    size_t count = 0;
+    double megawatts = 0;
+};
+
+//----------- GridPolicies.h -----------
+// Compile-time policy bundle for BasicGridController: how substations are
+// selected, which queue holds pending demands, and where time comes from.
+// The runtime members keep every choice open per controller or per tick
+// (the GridController default); the fixed ones bake a choice in, so the
+// tick's placement loop calls concrete, inlinable code with no virtual calls.
+
+// Selection under the AllocPolicy passed to each tick
+struct RuntimeAllocator {
+    static size_t select(const Region &rg, double mw, AllocPolicy policy) {
+        return (policy == AllocPolicy::SCAN_FIRST || policy == AllocPolicy::SCAN_BEST)
+             ? rg.store.select(mw, policy) : rg.index.select(mw, policy);
+    }
+};
+
+// Selection always under P; the tick's policy argument is ignored
+template <AllocPolicy P>
+struct FixedAllocator {
+    static size_t select(const Region &rg, double mw, AllocPolicy) {
+        if constexpr (P == AllocPolicy::SCAN_FIRST || P == AllocPolicy::SCAN_BEST)
+            return rg.store.select<P>(mw);
+        else
+            return rg.index.select<P>(mw);
+    }
+};
+
+// Backend picked per controller from its QueueBackend, behind DemandQueue's vtable
+struct RuntimeQueue {
+    using type = DemandQueue;
+    static unique_ptr<DemandQueue> make(QueueBackend backend) { return makeDemandQueue(backend); }
+};
+
+// Always Q (a final DemandQueue), so calls through it bind statically; the
+// controller's QueueBackend argument is ignored
+template <class Q>
+struct FixedQueue {
+    using type = Q;
+    static unique_ptr<DemandQueue> make(QueueBackend) { return unique_ptr<DemandQueue>(new Q()); }
+};
+
+// Time read through the controller's GridClock, so setClock can install a VirtualClock
+struct InjectedClock {
+    static constexpr bool injectable = true;
+    static time_t wallTime(const GridClock &c) { return c.wallTime(); }
+    static int64_t monotonic(const GridClock &c) { return c.monotonic(); }
+};
+
+// The system clocks called directly; such controllers cannot take setClock
+struct FixedSystemClock {
+    static constexpr bool injectable = false;
+    static time_t wallTime(const GridClock &) { return time(nullptr); }
+    static int64_t monotonic(const GridClock &) { return monotonicNanos(); }
+};
+
+template <class A, class Q, class C>
+struct GridPolicies {
+    using Allocator = A;
+    using Queue = Q;
+    using Clock = C;
+};
+
+using RuntimeGridPolicies = GridPolicies<RuntimeAllocator, RuntimeQueue, InjectedClock>;
+
+//----------- Snapshot.h -----------
+// Binary image of a controller for fast restart. Fixed-width sections follow the
+// header back to back, each 8-byte aligned, so a mapped file is used in place:
+//   SnapshotSubstation[substationCount]  (name = substation name table entry)
+//   SnapshotRequest[requestCount]        (every live request, queued or allocated)
+//   SnapshotLoad[loadCount]              (each substation's load list, in order)
+//   SnapshotJob[jobCount + historyCount] (active jobs, then finished history)
+//   SnapshotEvent[eventCount]            (pending maintenance edges)
+// then at namesOffset the substation and consumer name tables, each laid out as
+// uint32_t offsets[n + 1] then name bytes, padded to 8.
+struct SnapshotHeader {
+    char magic[8];            // "SGSNAP1" plus NUL
+    uint32_t version;         // Format version, currently 4 (3 lacked the settings, 2 deferrals, 1 journalLSN)
+    uint32_t substationCount;
+    uint64_t requestCount;
+    uint64_t loadCount;
+    uint32_t jobCount;
+    uint32_t historyCount;
+    uint32_t eventCount;
+    uint32_t consumerNameCount;
+    uint64_t nextSeq;
+    uint64_t nextJobID;
+    uint64_t namesOffset;
+    uint64_t journalLSN;      // Last journal record reflected in this image (0 = none)
+    double splitMinMW;        // Persistent scheduling settings, which the journal
+    uint8_t retryHorizon;     // tail only carries when they change again
+    uint8_t agingStep;
+    uint8_t pad[6];
+};
+
+struct SnapshotSubstation {
+    double capacityMW;
+    double usedMW;
+    int32_t maintenanceHolds;
+    uint32_t loadCount;       // Entries of this substation in the load section
+    uint16_t region;
+    uint8_t online;
+    uint8_t pad[5];
+};
+
+struct SnapshotRequest {
+    double megawatts;
+    int64_t timestamp;
+    uint64_t seq;
+    uint32_t consumer;        // Consumer name table index (== interned id)
+    uint16_t region;
+    uint8_t priority;         // Demand class tag
+    uint8_t state;            // DemandRequest::QUEUED or ALLOCATED
+    uint8_t deferrals;        // Ticks spent in the retry lane (queued only)
+    uint8_t boost;            // Priority levels gained by aging
+    uint8_t pad[6];
+};
+
+struct SnapshotLoad {
+    uint32_t request;         // Index into the request section
+    uint32_t pad;
+    double shareMW;           // Split share size; negative for a whole allocation
+};
+
+struct SnapshotJob {
+    uint64_t jobID;
+    int64_t startTime;
+    int64_t endTime;
+    uint32_t substation;
+    uint8_t state;            // MaintenanceJob::State
+    uint8_t pad[3];
+};
+
+struct SnapshotEvent {
+    int64_t at;
+    uint64_t jobID;
+    uint8_t start;
+    uint8_t pad[7];
+};
+
+static_assert(sizeof(SnapshotHeader) % 8 == 0 && sizeof(SnapshotSubstation) == 32
+              && sizeof(SnapshotRequest) == 40 && sizeof(SnapshotLoad) == 16
+              && sizeof(SnapshotJob) == 32 && sizeof(SnapshotEvent) == 24,
+              "snapshot records must stay fixed-width");
+
+static const char kSnapshotMagic[8] = {'S', 'G', 'S', 'N', 'A', 'P', '1', '\0'};
+
+//----------- Journal.h -----------
+// Append-only event journal between snapshots. Every accepted state change is
+// one fixed-width record; a NAME record carries its name bytes after it,
+// padded to 8. LSNs count records from 1 across the journal's lifetime, so a
+// snapshot can name the last record it already reflects.
+struct JournalRecord {
+    enum Type : uint8_t { NAME = 1, REPORT, RELEASE, MAINTENANCE, BALANCE, SPLIT };
+    uint64_t lsn;
+    uint32_t check;           // FNV-1a of the record (with check = 0) and its payload
+    uint8_t type;
+    uint8_t priority;         // REPORT: demand class tag; BALANCE: retry horizon
+    uint8_t policy;           // BALANCE: AllocPolicy
+    uint8_t flags;            // BALANCE: kJournalFull | kJournalBatch
+    uint32_t id;              // Consumer id (NAME, REPORT, RELEASE) or substation (MAINTENANCE)
+    uint16_t zone;            // REPORT: transmission zone; BALANCE: aging step
+    uint16_t pad;
+    uint32_t nameLen;         // NAME: payload bytes
+    uint32_t pad2;
+    double megawatts;         // REPORT: demand; SPLIT: minimum share
+    int64_t t0;               // REPORT: arrival ns; MAINTENANCE: start; BALANCE: tick time
+    int64_t t1;               // REPORT: arrival sequence; MAINTENANCE: end
+};
+static_assert(sizeof(JournalRecord) == 56, "JournalRecord must stay fixed-width");
+
+constexpr uint8_t kJournalFull = 1;    // BALANCE ran in BalanceMode::FULL
+constexpr uint8_t kJournalBatch = 2;   // BALANCE used batch packing
+
+inline uint32_t journalChecksum(const JournalRecord &r, string_view payload) {
+    JournalRecord copy = r;
+    copy.check = 0;
+    uint32_t h = 2166136261u;
+    const auto *b = reinterpret_cast<const unsigned char*>(&copy);
+    for (size_t i = 0; i < sizeof(copy); ++i) h = (h ^ b[i]) * 16777619u;
+    for (unsigned char c : payload) h = (h ^ c) * 16777619u;
+    return h;
+}
+
+// Group-commit writer. append() only copies into a buffer; a background thread
+// writes and fdatasyncs whatever has accumulated once it reaches 'flushBytes'
+// or 'flushInterval' has passed, so callers never wait on the disk.
+class Journal {
+    string path;
+    int fd = -1;
+    size_t flushBytes;
+    chrono::milliseconds flushInterval;
+    mutex m;
+    condition_variable wake;       // Flusher: data reached flushBytes, sync or stop requested
+    condition_variable flushed;    // Waiters in sync()
+    vector<char> pending;          // Appended, not yet handed to the flusher
+    uint64_t appended = 0;         // Bytes ever appended
+    uint64_t durable = 0;          // Bytes known to be on disk
+    bool syncWanted = false;
+    bool stopping = false;
+    string error;                  // First write failure; sticky
+    thread flusher;
+
+    void run() {
+        vector<char> writing;
+        unique_lock<mutex> lk(m);
+        while (true) {
+            wake.wait_for(lk, flushInterval, [&] {
+                return stopping || syncWanted || pending.size() >= flushBytes;
+            });
+            if (pending.empty()) {
+                syncWanted = false;
+                flushed.notify_all();
+                if (stopping) return;
+                continue;
+            }
+            writing.swap(pending);
+            uint64_t target = appended;
+            syncWanted = false;
+            lk.unlock();
+            const char *p = writing.data();
+            size_t left = writing.size();
+            string failure;
+            while (left > 0) {
+                ssize_t n = write(fd, p, left);
+                if (n < 0 && errno == EINTR) continue;
+                if (n <= 0) { failure = strerror(errno); break; }
+                p += n;
+                left -= size_t(n);
+            }
+            if (failure.empty() && fdatasync(fd) != 0) failure = strerror(errno);
+            writing.clear();
+            lk.lock();
+            if (!failure.empty() && error.empty()) error = path + ": " + failure;
+            durable = target;
+            flushed.notify_all();
+        }
+    }
+
+public:
+    static constexpr size_t kDefaultFlushBytes = size_t(64) << 10;
+    static constexpr chrono::milliseconds kDefaultFlushInterval{5};
+
+    Journal(size_t bytes = kDefaultFlushBytes,
+            chrono::milliseconds interval = kDefaultFlushInterval)
+      : flushBytes(bytes), flushInterval(interval) {}
+    Journal(const Journal &) = delete;
+    Journal &operator=(const Journal &) = delete;
+    ~Journal() { close(); }
+
+    // Open 'file' for appending and start the flusher; false with 'err' set on failure
+    bool open(const string &file, string &err) {
+        path = file;
+        fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+        if (fd < 0) { err = path + ": " + strerror(errno); return false; }
+        stopping = false;
+        flusher = thread([this] { run(); });
+        return true;
+    }
+
+    // Flush everything and stop the flusher
+    void close() {
+        if (fd < 0) return;
+        {
+            lock_guard<mutex> lk(m);
+            stopping = true;
+        }
+        wake.notify_one();
+        flusher.join();
+        ::close(fd);
+        fd = -1;
+    }
+
+    void append(const JournalRecord &r, string_view payload = string_view()) {
+        const char *b = reinterpret_cast<const char*>(&r);
+        size_t padded = (payload.size() + 7) & ~size_t(7);
+        bool full;
+        {
+            lock_guard<mutex> lk(m);
+            pending.insert(pending.end(), b, b + sizeof(r));
+            pending.insert(pending.end(), payload.begin(), payload.end());
+            pending.resize(pending.size() + padded - payload.size(), '\0');
+            appended += sizeof(r) + padded;
+            full = pending.size() >= flushBytes;
+        }
+        if (full) wake.notify_one();
+    }
+
+    // Block until everything appended so far is on disk; false with 'err' set on failure
+    bool sync(string &err) {
+        unique_lock<mutex> lk(m);
+        uint64_t target = appended;
+        syncWanted = true;
+        wake.notify_one();
+        flushed.wait(lk, [&] { return durable >= target || !error.empty(); });
+        err = error;
+        return error.empty();
+    }
+
+    // Move the file to 'path.old' and continue in a fresh 'path', replacing any
+    // earlier '.old'; false with 'err' set on failure
+    bool rotate(string &err) {
+        if (!sync(err)) return false;
+        close();
+        string old = path + ".old";
+        if (rename(path.c_str(), old.c_str()) != 0) {
+            err = path + ": " + strerror(errno);
+            string ignored;
+            open(path, ignored);   // Keep journaling to the current file
+            return false;
+        }
+        return open(path, err);
+    }
+
+    const string &file() const { return path; }
+};
+
+// Manages demands, substations, and maintenance. 'Policies' is a GridPolicies
+// bundle; GridController, the runtime bundle, is what everything outside the
+// benchmark uses.
+template <class Policies = RuntimeGridPolicies>
+class BasicGridController {
+    using Allocator = typename Policies::Allocator;
+    using QueueType = typename Policies::Queue::type;
+    using ClockPolicy = typename Policies::Clock;
+
+    QueueBackend backend;
+    vector<Region> regions;                  // Indexed by zone id; created on first use
+    unique_ptr<ThreadPool> pool;             // Runs per-region balancing when sharded
+    size_t workerThreads = max(1u, thread::hardware_concurrency());
+    bool crossRegion = true;                 // Let overflow use other zones' spare capacity
+    BalanceMode balanceMode = BalanceMode::INCREMENTAL;
+    TickDelta delta;                         // Changes seen by the last tick
+    size_t releasedSinceTick = 0;
+    double splitMinMW = 0;                   // Smallest split share; 0 disables splitting
+    bool batchPacking = false;               // Place each class largest-first as one batch
+    uint8_t retryHorizon = 0;                // Ticks an unplaced demand may wait before it is shed
+    uint8_t agingStep = 1;                   // Priority levels gained per deferred tick
+    vector<uint32_t> consumerLoads;          // Consumer id -> first allocated slot (kNoSlot if none)
+    vector<ClassTotals> pendingTotals;       // Queued demands by priority class
+    vector<ClassTotals> shedTotals;          // Demands shed since start, by priority class
+    vector<double> maintenanceShedMW;        // Per substation: MW shed moving load off it
+    SchedulerMetrics metrics;                // Cumulative counters and phase timings
+    const GridClock *clock = &SystemClock::instance();   // Time source for ticks and demands
+    RequestPool requests;                    // Owns all requests, addressed by DemandEntry::slot
+    atomic<uint64_t> nextSeq{0};             // Arrival sequence for FIFO order within a class
+    vector<IntakeRecord> drained;            // Drained records held behind a missing sequence, in seq order
+    uint64_t drainSeq = 0;                   // Next sequence drainIntake may enqueue
+    vector<Substation> substations;          // All substations in grid
+    StringTable substationNames;             // Substation name <-> id (== index in 'substations')
+    StringTable consumerNames;               // Consumer name <-> id carried by requests
+    mutable mutex consumerNamesMutex;        // Guards consumerNames against producer threads
+    IntakeRing intake;                       // Lock-free landing zone for receiveDemand
+    vector<IntakeRecord> intakeSpill;        // Records that arrived while the ring was full
+    mutable mutex intakeSpillMutex;          // Only taken on the ring-full slow path
+    atomic<bool> intakeSpilled{false};
+    map<size_t, MaintenanceJob> maintenanceJobs;   // Scheduled/in-progress jobs by job id
+    priority_queue<MaintenanceEvent, vector<MaintenanceEvent>, CompareEvent> maintenanceEvents;
+    deque<MaintenanceJob> maintenanceHistory;      // Most recent finished jobs
+    size_t nextJobID = 0;
+    static constexpr size_t kMaintenanceHistory = 64;
+    thread snapshotWriter;                   // Background write of the last snapshot
+    string snapshotError;                    // Its failure, if any; read after join
+    uint64_t snapshotLSN = 0;                // Journal LSN of the snapshot being written
+    uint64_t durableSnapshotLSN = 0;         // LSN covered by a snapshot known to be on disk
+    unique_ptr<Journal> journal;             // Event journal; null when not journaling
+    uint64_t journalLSN = 0;                 // Last LSN written or replayed
+    uint64_t journalOldLSN = 0;              // Last LSN in 'journal.old' (0 if none)
+    uint32_t journaledNames = 0;             // Consumer ids already carried by NAME records
+
+public:
+    static constexpr size_t kDefaultIntakeCapacity = size_t(1) << 16;
+
+    explicit BasicGridController(QueueBackend qb = QueueBackend::HEAP,
+                            size_t intakeCapacity = kDefaultIntakeCapacity)
+      : backend(qb), intake(intakeCapacity) {
+        region(0);
+    }
+
+    ~BasicGridController() {
+        if (snapshotWriter.joinable()) snapshotWriter.join();
+    }
+
+    // Capture the full controller state now and write it to 'path' on a
+    // background thread (via a temporary file renamed into place). Waits for
+    // any earlier snapshot first; false with 'err' set if that one failed.
+    bool saveSnapshot(const string &path, string &err);
+
+    // Wait for the background snapshot write, if any; false with 'err' set on failure
+    bool finishSnapshot(string &err) {
+        if (!snapshotWriter.joinable()) {
+            err.clear();
+            return true;
+        }
+        snapshotWriter.join();
+        err.swap(snapshotError);
+        snapshotError.clear();
+        if (err.empty()) durableSnapshotLSN = snapshotLSN;
+        return err.empty();
+    }
+
+    // Journal every state change from now on to 'path'. Call after any
+    // replayJournal() of the same file; false with 'err' set on failure.
+    bool openJournal(const string &path, string &err) {
+        unique_ptr<Journal> j(new Journal());
+        if (!j->open(path, err))
+            return false;
+        journal = move(j);
+        lock_guard<mutex> lk(consumerNamesMutex);
+        journaledNames = uint32_t(consumerNames.size());
+        return true;
+    }
+
+    bool journaling() const { return bool(journal); }
+
+    // Whether drainIntake has enqueued (and so journaled) every record up to 'seq'
+    bool drainedThrough(uint64_t seq) const { return drainSeq > seq; }
+
+    // Block until every journaled event is on disk (no-op without a journal)
+    bool syncJournal(string &err) {
+        err.clear();
+        return !journal || journal->sync(err);
+    }
+
+    // Re-apply 'path.old' then 'path' on top of the current state (a restored
+    // snapshot or the same starting grid), skipping records the snapshot already
+    // holds. A torn record at the end of 'path' is cut off. Returns the number
+    // of records applied, or -1 with 'err' set.
+    long long replayJournal(const string &path, string &err);
+
+    // Map a snapshot and rebuild state from it. Only valid on a controller with
+    // no substations, names or demands yet. False with 'err' set on a bad file;
+    // the controller may then hold part of the image and should be discarded.
+    bool loadSnapshot(const char *path, string &err);
+
+    // Read time from 'c' from now on; it must outlive the controller (or the
+    // next setClock). Install before any demands or maintenance are scheduled.
+    void setClock(const GridClock &c) {
+        static_assert(ClockPolicy::injectable, "this controller's clock policy is fixed");
+        clock = &c;
+    }
+    const GridClock &timeSource() const { return *clock; }
+    time_t now() const { return ClockPolicy::wallTime(*clock); }
+    int64_t nowNanos() const { return ClockPolicy::monotonic(*clock); }
+
+    // Add a substation to zone 'zone'; returns false if the id is already taken
+    bool addSubstation(string_view id, double cap, uint16_t zone = 0) {
+        uint32_t existing;
+        if (substationNames.find(id, existing))
+            return false;
+        uint32_t sid = substationNames.intern(id);
+        Region &rg = region(zone);
+        substations.emplace_back(sid, cap);
+        Substation &sub = substations.back();
+        sub.region = zone;
+        sub.regionPos = uint32_t(rg.subs.size());
+        rg.subs.push_back(sid);
+        rg.index.push(sub.available(), true);
+        rg.store.push(sub.capacityMW, sub.usedMW, true);
+        return true;
+    }
+
+    // Add every substation of 't' in bulk: each table is reserved once and each
+    // zone's indexes are built in a single pass over its new substations. The
+    // usable capacity is the lower of rating and feeder limit. False on an id
+    // that is already taken; the controller then holds part of 't' and should
+    // be discarded.
+    bool addTopology(const GridTopology &t) {
+        substations.reserve(substations.size() + t.size());
+        substationNames.reserve(substations.size() + t.size());
+        for (size_t i = 0; i < t.size(); ++i) {
+            uint32_t sid = substationNames.intern(t.ids[i]);
+            if (sid != substations.size())
+                return false;
+            substations.emplace_back(sid, min(t.capacityMW[i], t.feederLimitMW[i]));
+            Substation &sub = substations.back();
+            Region &rg = region(t.zone[i]);
+            sub.region = t.zone[i];
+            sub.regionPos = uint32_t(rg.subs.size());
+            rg.subs.push_back(sid);
+        }
+        vector<double> avail;
+        for (auto &rg : regions) {
+            size_t from = rg.index.size();
+            if (from == rg.subs.size()) continue;
+            avail.clear();
+            rg.store.reserve(rg.subs.size());
+            for (size_t k = from; k < rg.subs.size(); ++k) {
+                const Substation &sub = substations[rg.subs[k]];
+                avail.push_back(sub.available());
+                rg.store.push(sub.capacityMW, sub.usedMW, true);
+            }
+            rg.index.append(avail);
+        }
+        return true;
+    }
+
+    // The substations as addSubstation() was given them, current capacity included
+    GridTopology topology() const {
+        GridTopology t;
+        for (auto &s : substations) {
+            t.ids.emplace_back(substationNames.name(s.id));
+            t.capacityMW.push_back(s.capacityMW);
+            t.zone.push_back(s.region);
+            t.feederLimitMW.push_back(HUGE_VAL);
+        }
+        return t;
+    }
+
+    // Number of balancing lanes used when more than one region exists (>= 1)
+    void setWorkerThreads(size_t n) {
+        workerThreads = max<size_t>(1, n);
+        pool.reset();
+    }
+
+    // Whether demands a zone cannot serve may spill into other zones
+    void setCrossRegionOverflow(bool on) { crossRegion = on; }
+
+    // Allow a demand that fits nowhere whole to be split across substations of
+    // one zone, in shares of at least 'minChunkMW'; 0 turns splitting off
+    void setSplitAllocation(double minChunkMW) {
+        splitMinMW = max(0.0, minChunkMW);
+        if (journal) {
+            JournalRecord r = {};
+            r.type = JournalRecord::SPLIT;
+            r.megawatts = splitMinMW;
+            journalEvent(r);
+        }
+    }
+    double splitMinChunk() const { return splitMinMW; }
+
+    // Place a tick's pending demands one priority class at a time, largest first
+    // within the class (first-fit-decreasing under FIRST_FIT), instead of in
+    // arrival order. Classes still never overtake each other.
+    void setBatchPacking(bool on) { batchPacking = on; }
+    bool batchPackingEnabled() const { return batchPacking; }
+
+    // Keep a demand that found no room for up to 'ticks' further ticks instead of
+    // shedding it at once. Each deferral raises its queue priority by 'step'
+    // levels, so a waiting demand can overtake newer ones of a higher class.
+    // Deferred demands wait in their zone's retry lane, already in key order,
+    // and are merged with the queue during the next tick. 0 ticks sheds at once.
+    void setRetryHorizon(unsigned ticks, unsigned step = 1) {
+        retryHorizon = uint8_t(min(ticks, 255u));
+        agingStep = uint8_t(min(step, 255u));
+    }
+    unsigned retryTicks() const { return retryHorizon; }
+    unsigned retryAgingStep() const { return agingStep; }
+
+    // Default re-evaluation scope for runScheduler
+    void setBalanceMode(BalanceMode mode) { balanceMode = mode; }
+    const TickDelta &lastTickDelta() const { return delta; }
+    size_t regionCount() const { return regions.size(); }
+
+    // Look up a substation index by id; returns false if unknown
+    bool findSubstation(string_view id, uint32_t &idx) const {
+        return substationNames.find(id, idx);
+    }
+
+    // Interned id for a consumer name; requests carry this instead of the string.
+    // Safe from any thread; producers should resolve ids once and reuse them.
+    uint32_t consumerId(string_view name) {
+        lock_guard<mutex> lk(consumerNamesMutex);
+        return consumerNames.intern(name);
+    }
+    const string &consumerName(uint32_t id) const {
+        lock_guard<mutex> lk(consumerNamesMutex);
+        return consumerNames.name(id);
+    }
+    const string &substationName(uint32_t id) const { return substationNames.name(id); }
+
+    // Accept a demand of type T. Safe to call from many threads while the
+    // scheduler runs: the record takes the next global arrival sequence, lands
+    // in the lock-free intake ring, and becomes a pooled, queued request when
+    // the next tick (or status) drains it.
+    template <class T>
+    void receiveDemand(uint32_t consumer, double mw, int64_t ts, uint16_t zone = 0) {
+        receiveDemand(&makePooledRequest<T>, consumer, mw, ts, zone);
+    }
+
+    // Same, stamped now on the controller's clock, in zone 0
+    template <class T>
+    void receiveDemand(uint32_t consumer, double mw) {
+        receiveDemand<T>(consumer, mw, nowNanos());
+    }
+
+    // Same for a class chosen at run time by its pool factory (DemandClassInfo::make)
+    void receiveDemand(decltype(IntakeRecord::make) make, uint32_t consumer, double mw,
+                       int64_t ts, uint16_t zone) {
+        IntakeRecord rec = {mw, ts, nextSeq.fetch_add(1, memory_order_relaxed), consumer, zone, make};
+        if (intake.push(rec))
+            return;
+        // Ring full: park the record on the locked slow path rather than wait
+        lock_guard<mutex> lk(intakeSpillMutex);
+        intakeSpill.push_back(rec);
+        intakeSpilled.store(true, memory_order_release);
+    }
+
+    // Accept 'n' records at once (all fields but 'seq' filled in) with one
+    // sequence reservation and, while the ring has room, one ring claim. Same
+    // thread safety as receiveDemand.
+    void receiveDemands(IntakeRecord *recs, size_t n) {
+        uint64_t seq = nextSeq.fetch_add(n, memory_order_relaxed);
+        for (size_t i = 0; i < n; ++i) recs[i].seq = seq + i;
+        if (intake.pushBatch(recs, n))
+            return;
+        size_t i = 0;
+        while (i < n && intake.push(recs[i])) ++i;
+        if (i == n)
+            return;
+        lock_guard<mutex> lk(intakeSpillMutex);
+        intakeSpill.insert(intakeSpill.end(), recs + i, recs + n);
+        intakeSpilled.store(true, memory_order_release);
+    }
+
+    // Move everything accepted since the last drain into the region queues, in
+    // arrival-sequence order. Producers take a sequence number just before their
+    // ring push and spilled records wait outside the ring, so a drain can come
+    // out slightly shuffled; it is re-sorted only when it is. A producer may
+    // also still be between taking its number and pushing, so only the
+    // contiguous run from drainSeq is enqueued; later records wait in 'drained'
+    // for the gap to fill, keeping FIFO order across drains. Returns the number
+    // enqueued. Runs on the scheduler thread only.
+    size_t drainIntake() {
+        IntakeRecord rec;
+        while (intake.pop(rec)) drained.push_back(rec);
+        if (intakeSpilled.load(memory_order_acquire)) {
+            lock_guard<mutex> lk(intakeSpillMutex);
+            drained.insert(drained.end(), intakeSpill.begin(), intakeSpill.end());
+            SchedulerMetrics::add(metrics.spilled, intakeSpill.size());
+            intakeSpill.clear();
+            intakeSpilled.store(false, memory_order_relaxed);
+        }
+        auto bySeq = [](const IntakeRecord &a, const IntakeRecord &b) { return a.seq < b.seq; };
+        if (!is_sorted(drained.begin(), drained.end(), bySeq))
+            sort(drained.begin(), drained.end(), bySeq);
+        size_t n = 0;
+        for (; n < drained.size() && drained[n].seq <= drainSeq; ++n) {
+            enqueueRecord(drained[n]);
+            drainSeq = max(drainSeq, drained[n].seq + 1);
+        }
+        drained.erase(drained.begin(), drained.begin() + n);
+        SchedulerMetrics::add(metrics.received, n);
+        return n;
+    }
+
+    // Number of demands waiting in the queues or the intake
+    size_t pendingCount() const {
+        size_t n = intake.approxSize();
+        {
+            lock_guard<mutex> lk(intakeSpillMutex);
+            n += intakeSpill.size();
+        }
+        n += drained.size();
+        for (auto &rg : regions) n += queueOf(rg).size() + rg.deferred.size();
+        return n;
+    }
+
+    // Approximate bytes held by request storage, intake and the pending queues
+    size_t memoryUsage() const {
+        size_t b = requests.bytesReserved() + substationNames.bytesReserved()
+                 + intake.bytesReserved();
+        {
+            lock_guard<mutex> lk(consumerNamesMutex);
+            b += consumerNames.bytesReserved();
+        }
+        {
+            lock_guard<mutex> lk(intakeSpillMutex);
+            b += intakeSpill.capacity() * sizeof(IntakeRecord);
+        }
+        for (auto &rg : regions)
+            b += rg.queue->bytesReserved() + rg.store.bytesReserved()
+               + rg.deferred.capacity() * sizeof(DemandEntry);
+        return b;
+    }
+
+    // Complete every allocated demand of 'consumer' and hand its MW back to the
+    // carrying substations. O(1) per request via the consumer index; queued
+    // demands that have not been placed yet are left alone. Returns the count.
+    size_t releaseDemand(uint32_t consumer, double &releasedMW) {
+        releasedMW = 0;
+        size_t n = 0;
+        while (consumer < consumerLoads.size() && consumerLoads[consumer] != DemandRequest::kNoSlot) {
+            uint32_t slot = consumerLoads[consumer];
+            DemandRequest *req = requests.get(slot);
+            releasedMW += req->megawatts;
+            unassign(slot);
+            req->state = DemandRequest::COMPLETED;
+            requests.release(slot);
+            ++n;
+        }
+        releasedSinceTick += n;
+        if (journal && n) {
+            JournalRecord r = {};
+            r.type = JournalRecord::RELEASE;
+            r.id = consumer;
+            journalEvent(r);
+        }
+        return n;
+    }
+
+    // Release by consumer name; unknown names release nothing
+    size_t releaseDemand(string_view consumer, double &releasedMW) {
+        uint32_t id;
+        {
+            lock_guard<mutex> lk(consumerNamesMutex);
+            if (!consumerNames.find(consumer, id)) {
+                releasedMW = 0;
+                return 0;
+            }
+        }
+        return releaseDemand(id, releasedMW);
+    }
+
+    // Schedule a maintenance window [start, end); returns false for an unknown substation
+    bool scheduleMaintenance(string_view sid, time_t start, time_t end) {
+        uint32_t idx;
+        return findSubstation(sid, idx) && scheduleMaintenance(idx, start, end);
+    }
+
+    // Same, by substation index
+    bool scheduleMaintenance(uint32_t idx, time_t start, time_t end) {
+        if (idx >= substations.size())
+            return false;
+        if (journal) {
+            JournalRecord r = {};
+            r.type = JournalRecord::MAINTENANCE;
+            r.id = idx;
+            r.t0 = int64_t(start);
+            r.t1 = int64_t(end);
+            journalEvent(r);
+        }
+        size_t jobID = nextJobID++;
+        maintenanceJobs.emplace(jobID, MaintenanceJob(idx, start, end));
+        maintenanceEvents.push({start, jobID, true});
+        maintenanceEvents.push({end, jobID, false});
+        return true;
+    }
+
+    // Allocate 'mw' on substation 'i', keeping the capacity index current
+    bool allocateOn(size_t i, double mw) {
+        if (!substations[i].allocate(mw))
+            return false;
+        refreshIndex(i);
+        return true;
+    }
+
+    // Release 'mw' from substation 'i', keeping the capacity index current
+    void deallocateOn(size_t i, double mw) {
+        substations[i].deallocate(mw);
+        refreshIndex(i);
+    }
+
+    // Core scheduler: update maintenance, allocate demands or shed.
+    // Incremental ticks touch only what changed since the previous tick.
+    void runScheduler(AllocPolicy policy = AllocPolicy::FIRST_FIT) {
+        runScheduler(policy, balanceMode);
+    }
+
+    void runScheduler(AllocPolicy policy, BalanceMode mode) {
+        runScheduler(policy, mode, now());
+    }
+
+    // Tick as of 'now'; journal replay passes the recorded time
+    void runScheduler(AllocPolicy policy, BalanceMode mode, time_t now) {
+        using Clock = chrono::steady_clock;
+        Clock::time_point mark = Clock::now();
+        uint64_t nanos[SchedulerMetrics::kPhases] = {};
+        auto endPhase = [&](TickPhase p) {
+            Clock::time_point t = Clock::now();
+            nanos[size_t(p)] = uint64_t(chrono::duration_cast<chrono::nanoseconds>(t - mark).count());
+            mark = t;
+        };
+        auto finishTick = [&] {
+            for (size_t p = 0; p < SchedulerMetrics::kPhases; ++p) {
+                SchedulerMetrics::add(metrics.phaseNanos[p], nanos[p]);
+                metrics.lastPhaseNanos[p].store(nanos[p], memory_order_relaxed);
+            }
+            SchedulerMetrics::add(metrics.ticks, 1);
+            SchedulerMetrics::add(metrics.placed, delta.placed);
+            SchedulerMetrics::add(metrics.shed, delta.shed);
+            SchedulerMetrics::add(metrics.shedMW, delta.shedMW);
+            SchedulerMetrics::add(metrics.deferred, delta.deferred);
+            SchedulerMetrics::add(metrics.requeued, delta.requeued);
+            SchedulerMetrics::add(metrics.migrated, delta.migrated);
+            SchedulerMetrics::add(metrics.migrationShed, delta.migrationShed);
+            SchedulerMetrics::add(metrics.released, delta.released);
+        };
+
+        delta = TickDelta();
+        delta.newDemands = drainIntake();
+        if (journal) {
+            JournalRecord r = {};
+            r.type = JournalRecord::BALANCE;
+            r.policy = uint8_t(policy);
+            r.flags = uint8_t((mode == BalanceMode::FULL ? kJournalFull : 0)
+                              | (batchPacking ? kJournalBatch : 0));
+            r.priority = retryHorizon;
+            r.zone = agingStep;
+            r.t0 = int64_t(now);
+            journalEvent(r);
+        }
+        delta.released = releasedSinceTick;
+        releasedSinceTick = 0;
+        endPhase(TickPhase::INTAKE);
+
+        // 1) Fire due maintenance edges; a substation stays offline while any job holds it
+        vector<uint32_t> wentOffline;
+        advanceMaintenance(now, wentOffline);
+        endPhase(TickPhase::MAINTENANCE);
+
+        // 2) A full pass puts all load back into the queues; otherwise only the
+        //    load riding on substations that just went offline moves, in bulk
+        if (mode == BalanceMode::FULL) {
+            for (size_t i = 0; i < substations.size(); ++i) requeueLoads(uint32_t(i));
+        } else if (!wentOffline.empty()) {
+            migrateLoads(wentOffline, policy);
+        }
+        endPhase(TickPhase::REQUEUE);
+
+        // 3) Drain each region's queue against its own substations. Placements
+        //    are counted where they happen: producers may keep filling the
+        //    intake meanwhile, so queue sizes say nothing about this tick.
+        bool queued = false;
+        for (auto &rg : regions) queued |= !queueOf(rg).empty() || !rg.deferred.empty();
+        if (!queued) {
+            finishTick();
+            return;
+        }
+        balanceRegions(policy);
+        delta.placed += linkPlaced();
+        endPhase(TickPhase::ALLOCATE);
+
+        // 4) Serial overflow pass: try other zones, otherwise defer or shed
+        resolveOverflow(policy);
+        delta.placed += linkPlaced();
+        // Every queued demand was placed, shed or deferred, so only the retry lanes remain
+        fill(pendingTotals.begin(), pendingTotals.end(), ClassTotals());
+        for (auto &rg : regions)
+            for (auto &e : rg.deferred) {
+                const DemandRequest *req = requests.get(e.slot);
+                ClassTotals &t = pendingTotals[req->priority()];
+                ++t.count;
+                t.megawatts += req->megawatts;
+            }
+        endPhase(TickPhase::OVERFLOW);
+        finishTick();
+    }
+
+    // Apply maintenance edges due by 'now'; collects substations that went offline
+    void advanceMaintenance(time_t now, vector<uint32_t> &wentOffline) {
+        while (!maintenanceEvents.empty() && maintenanceEvents.top().at <= now) {
+            MaintenanceEvent ev = maintenanceEvents.top();
+            maintenanceEvents.pop();
+            auto it = maintenanceJobs.find(ev.jobID);
+            MaintenanceJob &job = it->second;
+            uint32_t subIdx = job.substationID;
+            Substation &sub = substations[subIdx];
+            job.advanceState(ev.at);
+            if (ev.start) {
+                if (sub.maintenanceHolds++ == 0) {
+                    wentOffline.push_back(subIdx);
+                    ++delta.wentOffline;
+                }
+                sub.online = false;
+            } else {
+                sub.online = (--sub.maintenanceHolds == 0);
+                if (sub.online) ++delta.cameOnline;
+                // Move finished job to the bounded history
+                maintenanceHistory.push_back(job);
+                if (maintenanceHistory.size() > kMaintenanceHistory)
+                    maintenanceHistory.pop_front();
+                maintenanceJobs.erase(it);
+            }
+            refreshIndex(subIdx);
+        }
+    }
+
+    // Regions share no substations or queues, so they run concurrently on the pool
+    void balanceRegions(AllocPolicy policy) {
+        auto balanceRegion = [&](size_t r) {
+            Region &rg = regions[r];
+            rg.overflow.clear();
+            if (batchPacking) {
+                packRegion(rg, policy);
+                return;
+            }
+            // The retry lane is already in key order; merge it with the queue
+            size_t d = 0;
+            for (;;) {
+                DemandEntry e;
+                QueueType &q = queueOf(rg);
+                if (d < rg.deferred.size() && (q.empty() || rg.deferred[d].key > q.top().key)) {
+                    e = rg.deferred[d++];
+                } else if (!q.empty()) {
+                    e = q.top();
+                    q.pop();
+                } else {
+                    break;
+                }
+                if (!placeInRegion(e.slot, rg, policy))
+                    rg.overflow.push_back(e);
+            }
+            rg.deferred.clear();
+        };
+        if (regions.size() > 1 && workerThreads > 1) {
+            if (!pool) pool.reset(new ThreadPool(workerThreads - 1));
+            pool->parallelFor(regions.size(), balanceRegion);
+        } else {
+            for (size_t r = 0; r < regions.size(); ++r) balanceRegion(r);
+        }
+    }
+
+    // Batch variant of the per-region loop: one sort of the whole queue by class,
+    // then MW descending, then arrival. Overflow is put back in dispatch order so
+    // cross-region placement and shedding see the same order as greedy mode.
+    void packRegion(Region &rg, AllocPolicy policy) {
+        rg.overflow.clear();
+        queueOf(rg).drainTo(rg.overflow);
+        rg.overflow.insert(rg.overflow.end(), rg.deferred.begin(), rg.deferred.end());
+        rg.deferred.clear();
+        rg.batch.clear();
+        for (auto &e : rg.overflow)
+            rg.batch.emplace_back(requests.get(e.slot)->megawatts, e);
+        sort(rg.batch.begin(), rg.batch.end(),
+             [](const pair<double, DemandEntry> &a, const pair<double, DemandEntry> &b) {
+                 int pa = demandKeyPriority(a.second.key), pb = demandKeyPriority(b.second.key);
+                 if (pa != pb) return pa > pb;
+                 if (a.first != b.first) return a.first > b.first;
+                 return a.second.key > b.second.key;
+             });
+        rg.overflow.clear();
+        for (auto &b : rg.batch)
+            if (!placeInRegion(b.second.slot, rg, policy))
+                rg.overflow.push_back(b.second);
+        sort(rg.overflow.begin(), rg.overflow.end(),
+             [](const DemandEntry &a, const DemandEntry &b) { return a.key > b.key; });
+    }
+
+    // Overflow in global priority order may use other zones' spare capacity;
+    // whatever still does not fit waits in the retry lane under an aged key while
+    // within the retry horizon, otherwise it is shed and its slot recycled
+    void resolveOverflow(AllocPolicy policy) {
+        vector<DemandEntry> spill;
+        for (auto &rg : regions)
+            spill.insert(spill.end(), rg.overflow.begin(), rg.overflow.end());
+        if (regions.size() > 1)
+            sort(spill.begin(), spill.end(),
+                 [](const DemandEntry &a, const DemandEntry &b) { return a.key > b.key; });
+        for (auto &e : spill) {
+            if (crossRegion && placeOutsideRegion(e.slot, policy))
+                continue;
+            DemandRequest *req = requests.get(e.slot);
+            if (req->deferrals < retryHorizon) {
+                ++req->deferrals;
+                req->boost = uint8_t(min(int(req->boost) + agingStep, 255));
+                ++delta.deferred;
+                delta.deferredMW += req->megawatts;
+                regions[req->region].deferred.push_back({pendingKey(*req), e.slot});
+                continue;
+            }
+            ++delta.shed;
+            delta.shedMW += req->megawatts;
+            noteShed(*req);
+            req->state = DemandRequest::SHED;
+            requests.release(e.slot);
+        }
+        sortDeferred();
+    }
+
+    // Put each retry lane back in key order; aging that saturates can reorder it
+    void sortDeferred() {
+        auto byKey = [](const DemandEntry &a, const DemandEntry &b) { return a.key > b.key; };
+        for (auto &rg : regions)
+            if (!is_sorted(rg.deferred.begin(), rg.deferred.end(), byKey))
+                sort(rg.deferred.begin(), rg.deferred.end(), byKey);
+    }
+
+    // Queue key of a request: its class plus any aging, then arrival order
+    uint64_t pendingKey(const DemandRequest &req) const {
+        return packDemandKey(req.priority() + req.boost, req.seq);
+    }
+
+    // Book request 'slot' on substation 'i'; false if it does not fit
+    bool assign(uint32_t slot, uint32_t i) {
+        DemandRequest *req = requests.get(slot);
+        if (!allocateOn(i, req->megawatts))
+            return false;
+        Substation &sub = substations[i];
+        req->state = DemandRequest::ALLOCATED;
+        req->deferrals = req->boost = 0;
+        req->substation = i;
+        req->loadPos = uint32_t(sub.loads.size());
+        sub.loads.push_back(slot);
+        regions[sub.region].placed.push_back(slot);
+        return true;
+    }
+
+    // Place a request in zone 'rg': whole under 'policy', else split if enabled
+    bool placeInRegion(uint32_t slot, Region &rg, AllocPolicy policy) {
+        double mw = requests.get(slot)->megawatts;
+        size_t local = Allocator::select(rg, mw, policy);
+        if (local != CapacityIndex::npos && assign(slot, rg.subs[local]))
+            return true;
+        return splitMinMW > 0 && splitAssign(slot, rg);
+    }
+
+    // Spread a request over the zone's emptiest substations, largest share first,
+    // with every share >= splitMinMW. Plans first so a miss changes nothing.
+    bool splitAssign(uint32_t slot, Region &rg) {
+        DemandRequest *req = requests.get(slot);
+        double remaining = req->megawatts;
+        if (remaining < 2 * splitMinMW)
+            return false;   // Would need a share below the minimum
+        rg.splitPlan.clear();
+        rg.index.forEachDescending([&](size_t local, double avail) {
+            if (avail < splitMinMW) return false;   // Every later one is smaller
+            double take = min(avail, remaining);
+            if (remaining - take > 0 && remaining - take < splitMinMW)
+                take = remaining - splitMinMW;      // Leave a valid final share
+            if (take >= splitMinMW) {
+                rg.splitPlan.emplace_back(local, take);
+                remaining -= take;
+            }
+            return remaining > 0;
+        });
+        if (remaining > 0)
+            return false;
+
+        uint32_t head = kNoShare;
+        for (size_t k = rg.splitPlan.size(); k-- > 0; ) {
+            uint32_t i = rg.subs[rg.splitPlan[k].first];
+            double mw = rg.splitPlan[k].second;
+            allocateOn(i, mw);
+            uint32_t id;
+            if (!rg.freeShares.empty()) {
+                id = rg.freeShares.back();
+                rg.freeShares.pop_back();
+            } else {
+                id = uint32_t(rg.shares.size());
+                rg.shares.emplace_back();
+            }
+            Substation &sub = substations[i];
+            rg.shares[id] = {mw, slot, i, uint32_t(sub.loads.size()), head};
+            sub.loads.push_back(id | kShareTag);
+            head = id;
+        }
+        req->state = DemandRequest::ALLOCATED;
+        req->deferrals = req->boost = 0;
+        req->split = true;
+        req->substation = rg.shares[head].substation;
+        req->loadPos = head;
+        rg.placed.push_back(slot);
+        return true;
+    }
+
+    // Request slot behind a load-list entry of substation 'i'
+    uint32_t loadEntrySlot(uint32_t i, uint32_t entry) const {
+        if (entry & kShareTag)
+            return regions[substations[i].region].shares[entry & ~kShareTag].slot;
+        return entry;
+    }
+
+    // Swap-remove position 'pos' from substation 'i''s load list
+    void removeLoadEntry(uint32_t i, uint32_t pos) {
+        Substation &sub = substations[i];
+        uint32_t moved = sub.loads.back();
+        sub.loads[pos] = moved;
+        if (moved & kShareTag)
+            regions[sub.region].shares[moved & ~kShareTag].loadPos = pos;
+        else
+            requests.get(moved)->loadPos = pos;
+        sub.loads.pop_back();
+    }
+
+    // Undo assign() or splitAssign(): return the MW and drop every load-list entry
+    void unassign(uint32_t slot) {
+        DemandRequest *req = requests.get(slot);
+        if (!req->split) {
+            removeLoadEntry(req->substation, req->loadPos);
+            deallocateOn(req->substation, req->megawatts);
+        } else {
+            Region &rg = regions[substations[req->substation].region];
+            for (uint32_t id = req->loadPos; id != kNoShare; ) {
+                LoadShare &sh = rg.shares[id];
+                removeLoadEntry(sh.substation, sh.loadPos);
+                deallocateOn(sh.substation, sh.mw);
+                uint32_t next = sh.next;
+                rg.freeShares.push_back(id);
+                id = next;
+            }
+            req->split = false;
+        }
+        req->substation = DemandRequest::kNoSubstation;
+        unlinkConsumerLoad(slot);
+    }
+
+    // Link every slot placed since the last call into its consumer's list and
+    // return how many there were. The lists and consumerLoads cross regions, so
+    // this runs serially after each placement phase rather than from assign()
+    // inside the parallel pass.
+    size_t linkPlaced() {
+        size_t n = 0;
+        for (auto &rg : regions) {
+            for (uint32_t slot : rg.placed) linkConsumerLoad(slot);
+            n += rg.placed.size();
+            rg.placed.clear();
+        }
+        return n;
+    }
+
+    // Add an allocated request to the front of its consumer's list
+    void linkConsumerLoad(uint32_t slot) {
+        DemandRequest *req = requests.get(slot);
+        if (consumerLoads.size() <= req->consumerID)
+            consumerLoads.resize(req->consumerID + 1, DemandRequest::kNoSlot);
+        uint32_t head = consumerLoads[req->consumerID];
+        req->consumerPrev = DemandRequest::kNoSlot;
+        req->consumerNext = head;
+        if (head != DemandRequest::kNoSlot) requests.get(head)->consumerPrev = slot;
+        consumerLoads[req->consumerID] = slot;
+    }
+
+    void unlinkConsumerLoad(uint32_t slot) {
+        DemandRequest *req = requests.get(slot);
+        if (req->consumerPrev != DemandRequest::kNoSlot)
+            requests.get(req->consumerPrev)->consumerNext = req->consumerNext;
+        else
+            consumerLoads[req->consumerID] = req->consumerNext;
+        if (req->consumerNext != DemandRequest::kNoSlot)
+            requests.get(req->consumerNext)->consumerPrev = req->consumerPrev;
+        req->consumerPrev = req->consumerNext = DemandRequest::kNoSlot;
+    }
+
+    // Move all allocations off the given (now offline) substations in one pass:
+    // lift them, order by priority key, and re-place each in its own zone first,
+    // then elsewhere. Anything that no longer fits is shed.
+    void migrateLoads(const vector<uint32_t> &subs, AllocPolicy policy) {
+        vector<pair<DemandEntry, uint32_t>> moving;   // With the substation it came off
+        for (uint32_t i : subs) {
+            Substation &sub = substations[i];
+            while (!sub.loads.empty()) {
+                // Lifting a split request also drops its shares elsewhere
+                uint32_t slot = loadEntrySlot(i, sub.loads.back());
+                DemandRequest *req = requests.get(slot);
+                moving.push_back({{packDemandKey(req->priority(), req->seq), slot}, i});
+                unassign(slot);
+            }
+        }
+        sort(moving.begin(), moving.end(),
+             [](const pair<DemandEntry, uint32_t> &a, const pair<DemandEntry, uint32_t> &b) {
+                 return a.first.key > b.first.key;
+             });
+        for (auto &m : moving) {
+            const DemandEntry &e = m.first;
+            DemandRequest *req = requests.get(e.slot);
+            double mw = req->megawatts;
+            if (placeInRegion(e.slot, regions[req->region], policy)
+                || (crossRegion && placeOutsideRegion(e.slot, policy))) {
+                ++delta.migrated;
+                delta.migratedMW += mw;
+            } else {
+                ++delta.migrationShed;
+                delta.migrationShedMW += mw;
+                noteShed(*req);
+                if (maintenanceShedMW.size() <= m.second) maintenanceShedMW.resize(m.second + 1);
+                maintenanceShedMW[m.second] += mw;
+                req->state = DemandRequest::SHED;
+                requests.release(e.slot);
+            }
+        }
+        linkPlaced();
+    }
+
+    // Release every load on substation 'i' and queue it again under its original key
+    void requeueLoads(uint32_t i) {
+        Substation &sub = substations[i];
+        while (!sub.loads.empty()) {
+            uint32_t slot = loadEntrySlot(i, sub.loads.back());
+            unassign(slot);
+            DemandRequest *req = requests.get(slot);
+            req->state = DemandRequest::QUEUED;
+            queuePending(slot);
+            ++delta.requeued;
+        }
+    }
+
+    // Re-key substation 'i' in its region's capacity index
+    void refreshIndex(size_t i) {
+        const Substation &sub = substations[i];
+        Region &rg = regions[sub.region];
+        rg.index.update(sub.regionPos, sub.available(), sub.online);
+        rg.store.update(sub.regionPos, sub.capacityMW, sub.usedMW, sub.online);
+    }
+
+    // Try every zone other than the request's own; allocate on the first that fits
+    bool placeOutsideRegion(uint32_t slot, AllocPolicy policy) {
+        const DemandRequest &req = *requests.get(slot);
+        for (size_t r = 0; r < regions.size(); ++r) {
+            if (r == req.region) continue;
+            if (placeInRegion(slot, regions[r], policy))
+                return true;
+        }
+        return false;
+    }
+
+    // Turn a drained intake record into a pooled request in its region's queue
+    void enqueueRecord(const IntakeRecord &rec) {
+        uint32_t slot = rec.make(requests, rec.consumer, rec.megawatts, rec.timestamp);
+        DemandRequest *req = requests.get(slot);
+        req->state = DemandRequest::QUEUED;
+        req->region = rec.zone;
+        req->seq = rec.seq;
+        region(rec.zone);
+        queuePending(slot);
+        if (journal) {
+            journalNames(rec.consumer);
+            JournalRecord r = {};
+            r.type = JournalRecord::REPORT;
+            r.priority = uint8_t(req->priority());
+            r.zone = rec.zone;
+            r.id = rec.consumer;
+            r.megawatts = rec.megawatts;
+            r.t0 = rec.timestamp;
+            r.t1 = int64_t(rec.seq);
+            journalEvent(r);
+        }
+    }
+
+    // Push request 'slot' into its region's queue under its original key, or
+    // into the retry lane if it was restored mid-deferral (sortDeferred after)
+    void queuePending(uint32_t slot) {
+        const DemandRequest *req = requests.get(slot);
+        int prio = req->priority();
+        if (req->deferrals)
+            regions[req->region].deferred.push_back({pendingKey(*req), slot});
+        else
+            queueOf(regions[req->region]).push({packDemandKey(prio, req->seq), slot});
+        if (pendingTotals.size() <= size_t(prio)) pendingTotals.resize(prio + 1);
+        ++pendingTotals[prio].count;
+        pendingTotals[prio].megawatts += req->megawatts;
+    }
+
+    void noteShed(const DemandRequest &req) {
+        int prio = req.priority();
+        if (shedTotals.size() <= size_t(prio)) shedTotals.resize(prio + 1);
+        ++shedTotals[prio].count;
+        shedTotals[prio].megawatts += req.megawatts;
+    }
+
+    // Append one event to the journal under the next LSN
+    void journalEvent(JournalRecord r, string_view payload = string_view()) {
+        r.lsn = ++journalLSN;
+        r.nameLen = uint32_t(payload.size());
+        r.check = journalChecksum(r, payload);
+        journal->append(r, payload);
+    }
+
+    // Make sure consumer ids up to 'id' are in the journal, in id order, so
+    // replay re-interns them to the same ids
+    void journalNames(uint32_t id) {
+        if (id < journaledNames)
+            return;
+        lock_guard<mutex> lk(consumerNamesMutex);
+        for (; journaledNames <= id; ++journaledNames) {
+            JournalRecord r = {};
+            r.type = JournalRecord::NAME;
+            r.id = journaledNames;
+            journalEvent(r, consumerNames.name(journaledNames));
+        }
+    }
+
+    // A region's queue as the bundle's queue type; statically bound when fixed
+    static QueueType &queueOf(Region &rg) { return static_cast<QueueType&>(*rg.queue); }
+    static const QueueType &queueOf(const Region &rg) { return static_cast<const QueueType&>(*rg.queue); }
+
+    // Region 'zone', creating it (and any lower ids) on first use
+    Region &region(uint16_t zone) {
+        while (regions.size() <= zone) {
+            regions.emplace_back();
+            regions.back().queue = Policies::Queue::make(backend);
+        }
+        return regions[zone];
+    }
+
+    // Visit all pending entries in global dispatch order
+    void forEachPending(const function<void(const DemandEntry&)> &fn) const {
+        if (regions.size() == 1 && regions[0].deferred.empty()) {
+            regions[0].queue->forEachOrdered(fn);
+            return;
+        }
+        vector<DemandEntry> all;
+        for (auto &rg : regions) {
+            rg.queue->forEachOrdered([&](const DemandEntry &e) { all.push_back(e); });
+            all.insert(all.end(), rg.deferred.begin(), rg.deferred.end());
+        }
+        sort(all.begin(), all.end(),
+             [](const DemandEntry &a, const DemandEntry &b) { return a.key > b.key; });
+        for (auto &e : all) fn(e);
+    }
+
+    const SchedulerMetrics &schedulerMetrics() const { return metrics; }
+
+    // Human-readable counters, phase timings and substation utilization
+    void showMetrics(ostream &os = cout) const {
+        const SchedulerMetrics &m = metrics;
+        auto get = SchedulerMetrics::get;
+        ostringstream buf;
+        buf << "--- Scheduler Metrics ---\n"
+            << "Ticks: " << get(m.ticks) << "\n"
+            << "Demands: " << get(m.received) << " received (" << get(m.spilled) << " spilled), "
+            << get(m.placed) << " placed, " << get(m.shed) << " shed ("
+            << m.shedMW.load(memory_order_relaxed) << " MW), " << get(m.released) << " released\n"
+            << "Moves: " << get(m.requeued) << " requeued, " << get(m.migrated) << " migrated, "
+            << get(m.migrationShed) << " shed by migration, " << get(m.deferred) << " deferred\n"
+            << "Phase time (total ms / last tick ms):\n";
+        for (size_t p = 0; p < SchedulerMetrics::kPhases; ++p)
+            buf << "  " << tickPhaseName(TickPhase(p)) << ": " << get(m.phaseNanos[p]) / 1e6
+                << " / " << get(m.lastPhaseNanos[p]) / 1e6 << "\n";
+        buf << "Utilization:\n";
+        for (auto &s : substations)
+            buf << "  " << substationName(s.id) << ": "
+                << (s.capacityMW > 0 ? 100.0 * s.usedMW / s.capacityMW : 0.0) << "%"
+                << (s.online ? "" : " (OFFLINE)") << "\n";
+        os << buf.str();
+    }
+
+    // Prometheus text exposition of the same data
+    void writePrometheus(ostream &os) const {
+        const SchedulerMetrics &m = metrics;
+        auto get = SchedulerMetrics::get;
+        ostringstream buf;
+        buf.precision(15);   // Counters must not collapse into 6-digit exponents
+        auto label = [](const string &v) {
+            string out;
+            for (char c : v) {
+                if (c == '\\' || c == '"') out += '\\';
+                if (c == '\n') { out += "\\n"; continue; }
+                out += c;
+            }
+            return out;
+        };
+        auto counter = [&](const char *name, const char *help, double v) {
+            buf << "# HELP smartgrid_" << name << " " << help << "\n"
+                << "# TYPE smartgrid_" << name << " counter\n"
+                << "smartgrid_" << name << " " << v << "\n";
+        };
+        counter("ticks_total", "Balance ticks run.", double(get(m.ticks)));
+        counter("demands_received_total", "Demands taken from intake.", double(get(m.received)));
+        counter("demands_spilled_total", "Demands that arrived while the intake ring was full.",
+                double(get(m.spilled)));
+        counter("demands_placed_total", "Queued demands allocated.", double(get(m.placed)));
+        counter("demands_shed_total", "Queued demands shed.", double(get(m.shed)));
+        counter("demands_deferred_total", "Unplaced demands held in a retry lane for another tick.",
+                double(get(m.deferred)));
+        counter("shed_megawatts_total", "MW of queued demand shed.", m.shedMW.load(memory_order_relaxed));
+        counter("demands_requeued_total", "Allocations re-placed by full ticks.", double(get(m.requeued)));
+        counter("demands_migrated_total", "Allocations moved off substations entering maintenance.",
+                double(get(m.migrated)));
+        counter("migration_shed_total", "Allocations shed because migration found no room.",
+                double(get(m.migrationShed)));
+        counter("demands_released_total", "Allocations completed through release.",
+                double(get(m.released)));
+
+        buf << "# HELP smartgrid_phase_seconds_total Time spent in each balance tick phase.\n"
+            << "# TYPE smartgrid_phase_seconds_total counter\n";
+        for (size_t p = 0; p < SchedulerMetrics::kPhases; ++p)
+            buf << "smartgrid_phase_seconds_total{phase=\"" << tickPhaseName(TickPhase(p)) << "\"} "
+                << get(m.phaseNanos[p]) / 1e9 << "\n";
+        buf << "# HELP smartgrid_last_tick_phase_seconds Phase time in the latest tick.\n"
+            << "# TYPE smartgrid_last_tick_phase_seconds gauge\n";
+        for (size_t p = 0; p < SchedulerMetrics::kPhases; ++p)
+            buf << "smartgrid_last_tick_phase_seconds{phase=\"" << tickPhaseName(TickPhase(p)) << "\"} "
+                << get(m.lastPhaseNanos[p]) / 1e9 << "\n";
+
+        buf << "# HELP smartgrid_pending_demands Demands waiting in the queues.\n"
+            << "# TYPE smartgrid_pending_demands gauge\n";
+        for (size_t p = 0; p < pendingTotals.size(); ++p)
+            buf << "smartgrid_pending_demands{priority=\"" << p << "\"} " << pendingTotals[p].count << "\n";
+
+        buf << "# HELP smartgrid_substation_used_megawatts Allocated load per substation.\n"
+            << "# TYPE smartgrid_substation_used_megawatts gauge\n";
+        for (auto &s : substations)
+            buf << "smartgrid_substation_used_megawatts{substation=\"" << label(substationName(s.id)) << "\"} "
+                << s.usedMW << "\n";
+        buf << "# HELP smartgrid_substation_capacity_megawatts Capacity per substation.\n"
+            << "# TYPE smartgrid_substation_capacity_megawatts gauge\n";
+        for (auto &s : substations)
+            buf << "smartgrid_substation_capacity_megawatts{substation=\"" << label(substationName(s.id)) << "\"} "
+                << s.capacityMW << "\n";
+        buf << "# HELP smartgrid_substation_online Whether the substation is in service.\n"
+            << "# TYPE smartgrid_substation_online gauge\n";
+        for (auto &s : substations)
+            buf << "smartgrid_substation_online{substation=\"" << label(substationName(s.id)) << "\"} "
+                << int(s.online) << "\n";
+        os << buf.str();
+    }
+
+    // Time of the earliest pending maintenance edge; false if none is scheduled
+    bool nextMaintenanceEdge(time_t &at) const {
+        if (maintenanceEvents.empty()) return false;
+        at = maintenanceEvents.top().at;
+        return true;
+    }
+
+    // Queued demands of priority class 'prio', kept up to date on every push and tick
+    ClassTotals pendingByClass(int prio) const {
+        return size_t(prio) < pendingTotals.size() ? pendingTotals[prio] : ClassTotals();
+    }
+
+    // Demands of class 'prio' shed since start, by a tick or by maintenance migration
+    ClassTotals shedByClass(int prio) const {
+        return size_t(prio) < shedTotals.size() ? shedTotals[prio] : ClassTotals();
+    }
+
+    // MW shed because substation 'i' went into maintenance and its load found no room
+    double maintenanceShedAt(uint32_t i) const {
+        return i < maintenanceShedMW.size() ? maintenanceShedMW[i] : 0;
+    }
+
+    // First 'n' pending demands in dispatch order across all zones
+    void topPending(size_t n, vector<DemandEntry> &out) const {
+        out.clear();
+        bool deferred = false;
+        for (auto &rg : regions) {
+            rg.queue->topEntries(n, out);
+            out.insert(out.end(), rg.deferred.begin(),
+                       rg.deferred.begin() + min(n, rg.deferred.size()));
+            deferred |= !rg.deferred.empty();
+        }
+        if (regions.size() > 1 || deferred) {
+            sort(out.begin(), out.end(),
+                 [](const DemandEntry &a, const DemandEntry &b) { return a.key > b.key; });
+            if (out.size() > n) out.resize(n);
+        }
+    }
+
+    // Totals only, O(substations + classes): substation load, queued demands per
+    // class (highest first), pool and maintenance counts
+    void showSummary(ostream &os = cout) {
+        drainIntake();
+        ostringstream buf;
+        size_t online = 0;
+        double used = 0, cap = 0;
+        for (auto &s : substations) {
+            online += s.online;
+            used += s.usedMW;
+            cap += s.capacityMW;
+        }
+        buf << "--- Grid Summary ---\n"
+            << "Substations: " << substations.size() << " (" << online << " online), "
+            << used << "/" << cap << " MW used\n";
+        size_t n = 0;
+        double mw = 0;
+        for (auto &t : pendingTotals) { n += t.count; mw += t.megawatts; }
+        buf << "Pending Demands: " << n << " (" << mw << " MW)\n";
+        for (size_t p = pendingTotals.size(); p-- > 0; )
+            if (pendingTotals[p].count)
+                buf << "  pr=" << p << ": " << pendingTotals[p].count << " ("
+                    << pendingTotals[p].megawatts << " MW)\n";
+        buf << "Request pool: " << requests.live() << " live, "
+            << requests.freeCount() << " free slots, " << memoryUsage() / 1024 << " KiB\n"
+            << "Maintenance Jobs: " << maintenanceJobs.size() << " active, "
+            << maintenanceHistory.size() << " finished\n";
+        os << buf.str();
+    }
+
+    // Page 'page' (from 0) of the pending queue in dispatch order, 'k' per page
+    void showTopPending(size_t k, size_t page, ostream &os = cout) {
+        drainIntake();
+        vector<DemandEntry> top;
+        topPending((page + 1) * k, top);
+        ostringstream buf;
+        size_t total = 0;
+        for (auto &t : pendingTotals) total += t.count;
+        size_t first = page * k, last = min(first + k, total);
+        if (first >= total)
+            buf << "Pending Demands: page " << page << " is empty (" << total << " pending)\n";
+        else
+            buf << "Pending Demands " << first + 1 << "-" << last << " of " << total << ":\n";
+        lock_guard<mutex> lk(consumerNamesMutex);
+        for (size_t i = page * k; i < top.size(); ++i) {
+            auto *r = requests.get(top[i].slot);
+            buf << "  " << consumerNames.name(r->consumerID) << " (" << r->megawatts
+                << "MW, pr=" << demandKeyPriority(top[i].key) << ")\n";
+        }
+        os << buf.str();
+    }
+
+    // Display current grid status: substations, demands, maintenance. The full
+    // listing is built in memory and handed to 'os' in one write.
+    void showStatus(ostream &out = cout) {
+        drainIntake();
+        ostringstream os;
+        os << "--- Grid Status ---\n";
+
+        os << "Substations:" << "\n";
+        bool zoned = regions.size() > 1;
+        for (auto &s : substations) {
+            os << "  " << substationName(s.id);
+            if (zoned) os << " [zone " << s.region << "]";
+            os << ": " << s.usedMW << "/" << s.capacityMW
+               << (s.online ? " MW (ONLINE)" : " MW (OFFLINE)") << "\n";
+        }
+
+        os << "Pending Demands:" << "\n";
+        {
+            lock_guard<mutex> lk(consumerNamesMutex);
+            forEachPending([&](const DemandEntry &e) {
+                auto *r = requests.get(e.slot);
+                os << "  " << consumerNames.name(r->consumerID) << " (" << r->megawatts
+                   << "MW, pr=" << demandKeyPriority(e.key) << ")\n";
+            });
+        }
+
+        os << "Request pool: " << requests.live() << " live, "
+           << requests.freeCount() << " free slots, "
+           << memoryUsage() / 1024 << " KiB\n";
+
+        os << "Maintenance Jobs:" << "\n";
+        for (auto &m : maintenanceHistory) {
+            os << "  " << substationName(m.substationID) << " [" << m.state << "]\n";
+        }
+        for (auto &kv : maintenanceJobs) {
+            os << "  " << substationName(kv.second.substationID) << " [" << kv.second.state << "]\n";
+        }
+        out << os.str();
+    }
+};
+
+// The controller used everywhere outside the benchmark: every choice made at run time
+using GridController = BasicGridController<>;
+
+//----------- DemandClass.h -----------
+// A demand class accepted on input: its code, priority and how to enqueue it.
+// New classes need a DemandRequest subclass and one row in demandClasses().
+struct DemandClassInfo {
+    const char *code;     // Token used by 'report', e.g. "res"
+    int priority;         // Same value the subclass returns from priority()
+    void (*submit)(GridController &grid, uint32_t consumer, double mw, int64_t ts, uint16_t zone);
+    uint32_t (*make)(RequestPool &pool, uint32_t consumer, double mw, int64_t ts);  // Snapshot restore
+};
+
+template <class T>
+void submitDemand(GridController &grid, uint32_t consumer, double mw, int64_t ts, uint16_t zone) {
+    grid.receiveDemand<T>(consumer, mw, ts, zone);
+}
+
+inline const vector<DemandClassInfo> &demandClasses() {
+    static const vector<DemandClassInfo> table = {
+        {"res", 1, &submitDemand<ResidentialRequest>, &makePooledRequest<ResidentialRequest>},
+        {"com", 2, &submitDemand<CommercialRequest>, &makePooledRequest<CommercialRequest>},
+        {"ind", 3, &submitDemand<IndustrialRequest>, &makePooledRequest<IndustrialRequest>},
+    };
+    return table;
+}
+
+// Look up a demand class by priority (the binary log's class tag); nullptr if unknown
+inline const DemandClassInfo *findDemandClassByPriority(int priority) {
+    for (auto &c : demandClasses())
+        if (c.priority == priority) return &c;
+    return nullptr;
+}
+
+// Look up a demand class by its input code; nullptr if unknown
+inline const DemandClassInfo *findDemandClass(string_view code) {
+    for (auto &c : demandClasses())
+        if (code == c.code) return &c;
+    return nullptr;
+}
+
+//----------- Snapshot.cpp -----------
+template <class T>
+void appendSnapshotBytes(vector<char> &buf, const T *p, size_t n) {
+    const char *b = reinterpret_cast<const char*>(p);
+    buf.insert(buf.end(), b, b + n * sizeof(T));
+}
+
+// Append a name table (offsets then bytes) padded to 8; name(i) is entry i
+template <class NameAt>
+void appendSnapshotNames(vector<char> &buf, uint32_t count, NameAt name) {
+    uint32_t off = 0;
+    for (uint32_t i = 0; i < count; ++i) {
+        appendSnapshotBytes(buf, &off, 1);
+        off += uint32_t(name(i).size());
+    }
+    appendSnapshotBytes(buf, &off, 1);
+    for (uint32_t i = 0; i < count; ++i)
+        appendSnapshotBytes(buf, name(i).data(), name(i).size());
+    buf.resize((buf.size() + 7) & ~size_t(7), '\0');
+}
+
+inline void appendSnapshotNames(vector<char> &buf, const StringTable &names) {
+    appendSnapshotNames(buf, uint32_t(names.size()),
+                        [&](uint32_t i) -> const string & { return names.name(i); });
+}
+
+// Read the name table at 'pos' in a mapped snapshot, advancing 'pos' past its
+// padding; false if its offsets are not ascending from 0 or run past 'len'
+inline bool readSnapshotNames(const char *base, size_t len, size_t &pos, uint32_t count,
+                              const function<void(string_view)> &fn) {
+    size_t tableBytes = (size_t(count) + 1) * sizeof(uint32_t);
+    if (pos > len || tableBytes > len - pos) return false;
+    const auto *offs = reinterpret_cast<const uint32_t*>(base + pos);
+    size_t blob = pos + tableBytes;
+    if (offs[0] != 0 || offs[count] > len - blob) return false;
+    for (uint32_t i = 0; i < count; ++i) {
+        if (offs[i] > offs[i + 1]) return false;
+        fn(string_view(base + blob + offs[i], offs[i + 1] - offs[i]));
+    }
+    pos = (blob + offs[count] + 7) & ~size_t(7);
+    return true;
+}
+
+// Write 'data' to 'path.tmp', fsync it and rename it over 'path'; false with
+// 'err' set on failure, leaving any previous 'path' in place
+inline bool writeFileReplacing(const string &path, const vector<char> &data, string &err) {
+    string tmp = path + ".tmp";
+    int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) { err = tmp + ": " + strerror(errno); return false; }
+    const char *p = data.data();
+    size_t left = data.size();
+    while (left > 0) {
+        ssize_t n = write(fd, p, left);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        p += n;
+        left -= size_t(n);
+    }
+    bool ok = left == 0 && fsync(fd) == 0;
+    ok = close(fd) == 0 && ok;
+    if (!ok || rename(tmp.c_str(), path.c_str()) != 0) {
+        err = path + ": " + strerror(errno);
+        unlink(tmp.c_str());
+        return false;
+    }
+    return true;
+}
+
+template <class Policies>
+inline bool BasicGridController<Policies>::saveSnapshot(const string &path, string &err) {
+    if (!finishSnapshot(err))
+        return false;
+    drainIntake();
+
+    // Start a new journal file at this LSN. 'journal.old' is only replaced once
+    // a snapshot on disk covers it; until then the journal keeps growing.
+    if (journal && journalOldLSN <= durableSnapshotLSN) {
+        if (!journal->rotate(err))
+            return false;
+        journalOldLSN = journalLSN;
+    }
+    snapshotLSN = journalLSN;
+
+    // Number every live request by slot order
+    vector<uint32_t> index(requests.slotLimit(), UINT32_MAX);
+    vector<SnapshotRequest> reqs;
+    reqs.reserve(requests.live());
+    for (uint32_t s = 0; s < requests.slotLimit(); ++s) {
+        if (!requests.isLive(s)) continue;
+        const DemandRequest &r = *requests.get(s);
+        index[s] = uint32_t(reqs.size());
+        reqs.push_back({r.megawatts, r.timestamp, r.seq, r.consumerID, r.region,
+                        uint8_t(r.priority()), uint8_t(r.state), r.deferrals, r.boost, {}});
+    }
+
+    vector<SnapshotSubstation> subs;
+    vector<SnapshotLoad> loads;
+    subs.reserve(substations.size());
+    for (auto &sub : substations) {
+        subs.push_back({sub.capacityMW, sub.usedMW, int32_t(sub.maintenanceHolds),
+                        uint32_t(sub.loads.size()), sub.region, uint8_t(sub.online), {}});
+        const Region &rg = regions[sub.region];
+        for (uint32_t entry : sub.loads) {
+            if (entry & kShareTag) {
+                const LoadShare &sh = rg.shares[entry & ~kShareTag];
+                loads.push_back({index[sh.slot], 0, sh.mw});
+            } else {
+                loads.push_back({index[entry], 0, -1.0});
+            }
+        }
+    }
+
+    vector<SnapshotJob> jobs;
+    for (auto &kv : maintenanceJobs)
+        jobs.push_back({kv.first, int64_t(kv.second.startTime), int64_t(kv.second.endTime),
+                        kv.second.substationID, uint8_t(kv.second.state), {}});
+    for (auto &j : maintenanceHistory)
+        jobs.push_back({0, int64_t(j.startTime), int64_t(j.endTime), j.substationID,
+                        uint8_t(j.state), {}});
+    vector<SnapshotEvent> events;
+    for (auto pending = maintenanceEvents; !pending.empty(); pending.pop())
+        events.push_back({int64_t(pending.top().at), pending.top().jobID,
+                          uint8_t(pending.top().start), {}});
+
+    SnapshotHeader h = {};
+    memcpy(h.magic, kSnapshotMagic, sizeof(h.magic));
+    h.version = 4;
+    h.substationCount = uint32_t(subs.size());
+    h.requestCount = reqs.size();
+    h.loadCount = loads.size();
+    h.jobCount = uint32_t(maintenanceJobs.size());
+    h.historyCount = uint32_t(maintenanceHistory.size());
+    h.eventCount = uint32_t(events.size());
+    h.nextSeq = nextSeq.load(memory_order_relaxed);
+    h.nextJobID = nextJobID;
+    h.journalLSN = journalLSN;
+    h.splitMinMW = splitMinMW;
+    h.retryHorizon = retryHorizon;
+    h.agingStep = agingStep;
+    h.namesOffset = sizeof(h) + subs.size() * sizeof(SnapshotSubstation)
+                  + reqs.size() * sizeof(SnapshotRequest) + loads.size() * sizeof(SnapshotLoad)
+                  + jobs.size() * sizeof(SnapshotJob) + events.size() * sizeof(SnapshotEvent);
+
+    auto buf = make_shared<vector<char>>();
+    buf->reserve(h.namesOffset + (substations.size() + reqs.size()) * 16);
+    buf->resize(sizeof(h));
+    appendSnapshotBytes(*buf, subs.data(), subs.size());
+    appendSnapshotBytes(*buf, reqs.data(), reqs.size());
+    appendSnapshotBytes(*buf, loads.data(), loads.size());
+    appendSnapshotBytes(*buf, jobs.data(), jobs.size());
+    appendSnapshotBytes(*buf, events.data(), events.size());
+    appendSnapshotNames(*buf, substationNames);
+    {
+        lock_guard<mutex> lk(consumerNamesMutex);
+        h.consumerNameCount = uint32_t(consumerNames.size());
+        appendSnapshotNames(*buf, consumerNames);
+    }
+    memcpy(buf->data(), &h, sizeof(h));
+
+    // The scheduler carries on while the image goes to disk
+    snapshotWriter = thread([this, buf, path] {
+        writeFileReplacing(path, *buf, snapshotError);
+    });
+    return true;
+}
+
+template <class Policies>
+inline bool BasicGridController<Policies>::loadSnapshot(const char *path, string &err) {
+    if (!substations.empty() || consumerNames.size() || requests.live() || pendingCount()
+        || !maintenanceJobs.empty()) {
+        err = "controller already has state";
+        return false;
+    }
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) { err = strerror(errno); return false; }
+    struct stat stbuf;
+    if (fstat(fd, &stbuf) != 0 || size_t(stbuf.st_size) < sizeof(SnapshotHeader)) {
+        close(fd);
+        err = "file too small for a snapshot";
+        return false;
+    }
+    size_t len = size_t(stbuf.st_size);
+    void *map = mmap(nullptr, len, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) { err = strerror(errno); return false; }
+    madvise(map, len, MADV_SEQUENTIAL);
+    unique_ptr<void, function<void(void*)>> unmap(map, [len](void *m) { munmap(m, len); });
+
+    const char *base = static_cast<const char*>(map);
+    const auto *h = reinterpret_cast<const SnapshotHeader*>(base);
+    err = "not a valid snapshot";
+    uint64_t jobTotal = uint64_t(h->jobCount) + h->historyCount;
+    uint64_t limit = len / 16;   // No well-formed count can exceed this
+    if (memcmp(h->magic, kSnapshotMagic, sizeof(kSnapshotMagic)) != 0 || h->version != 4
+        || h->requestCount > limit || h->loadCount > limit
+        || h->namesOffset != sizeof(*h) + h->substationCount * sizeof(SnapshotSubstation)
+                             + h->requestCount * sizeof(SnapshotRequest)
+                             + h->loadCount * sizeof(SnapshotLoad)
+                             + jobTotal * sizeof(SnapshotJob)
+                             + h->eventCount * sizeof(SnapshotEvent)
+        || h->namesOffset > len)
+        return false;
+    const auto *subRecs = reinterpret_cast<const SnapshotSubstation*>(base + sizeof(*h));
+    const auto *reqRecs = reinterpret_cast<const SnapshotRequest*>(subRecs + h->substationCount);
+    const auto *loadRecs = reinterpret_cast<const SnapshotLoad*>(reqRecs + h->requestCount);
+    const auto *jobRecs = reinterpret_cast<const SnapshotJob*>(loadRecs + h->loadCount);
+    const auto *eventRecs = reinterpret_cast<const SnapshotEvent*>(jobRecs + jobTotal);
+
+    // Names first: substation ids equal their index, consumer ids their table position
+    size_t pos = h->namesOffset;
+    vector<string_view> subNames;
+    subNames.reserve(h->substationCount);
+    if (!readSnapshotNames(base, len, pos, h->substationCount,
+                           [&](string_view n) { subNames.push_back(n); }))
+        return false;
+    {
+        lock_guard<mutex> lk(consumerNamesMutex);
+        if (!readSnapshotNames(base, len, pos, h->consumerNameCount,
+                               [&](string_view n) { consumerNames.intern(n); })
+            || consumerNames.size() != h->consumerNameCount)
+            return false;
+    }
+
+    uint64_t loadTotal = 0;
+    for (uint32_t i = 0; i < h->substationCount; ++i) {
+        const SnapshotSubstation &r = subRecs[i];
+        if (!addSubstation(subNames[i], r.capacityMW, r.region))
+            return false;
+        Substation &sub = substations[i];
+        sub.usedMW = r.usedMW;
+        sub.online = r.online != 0;
+        sub.maintenanceHolds = r.maintenanceHolds;
+        refreshIndex(i);
+        loadTotal += r.loadCount;
+    }
+    if (loadTotal != h->loadCount)
+        return false;
+
+    vector<uint32_t> slots(h->requestCount);
+    for (uint64_t k = 0; k < h->requestCount; ++k) {
+        const SnapshotRequest &r = reqRecs[k];
+        const DemandClassInfo *cls = findDemandClassByPriority(r.priority);
+        if (!cls || r.consumer >= h->consumerNameCount
+            || (r.state != DemandRequest::QUEUED && r.state != DemandRequest::ALLOCATED))
+            return false;
+        uint32_t slot = cls->make(requests, r.consumer, r.megawatts, r.timestamp);
+        DemandRequest *req = requests.get(slot);
+        req->region = r.region;
+        req->seq = r.seq;
+        slots[k] = slot;
+        // Allocated requests may sit in another zone than their own, which
+        // then has no substations; migration and requeue still index it
+        region(r.region);
+        if (r.state == DemandRequest::QUEUED) {
+            req->state = DemandRequest::QUEUED;
+            req->deferrals = r.deferrals;
+            req->boost = r.boost;
+            queuePending(slot);
+        }
+    }
+    sortDeferred();
+
+    // Rebuild load lists in their saved order; a request turns ALLOCATED on its first entry
+    const SnapshotLoad *ld = loadRecs;
+    for (uint32_t i = 0; i < h->substationCount; ++i) {
+        Substation &sub = substations[i];
+        Region &rg = regions[sub.region];
+        for (uint32_t n = 0; n < subRecs[i].loadCount; ++n, ++ld) {
+            if (ld->request >= h->requestCount
+                || reqRecs[ld->request].state != DemandRequest::ALLOCATED)
+                return false;
+            uint32_t slot = slots[ld->request];
+            DemandRequest *req = requests.get(slot);
+            bool first = req->state != DemandRequest::ALLOCATED;
+            if (ld->shareMW < 0) {
+                if (!first) return false;   // A whole allocation has exactly one entry
+                req->substation = i;
+                req->loadPos = uint32_t(sub.loads.size());
+                sub.loads.push_back(slot);
+            } else {
+                if (!first && !req->split) return false;
+                uint32_t id;
+                if (!rg.freeShares.empty()) {
+                    id = rg.freeShares.back();
+                    rg.freeShares.pop_back();
+                } else {
+                    id = uint32_t(rg.shares.size());
+                    rg.shares.emplace_back();
+                }
+                rg.shares[id] = {ld->shareMW, slot, i, uint32_t(sub.loads.size()),
+                                 first ? kNoShare : req->loadPos};
+                sub.loads.push_back(id | kShareTag);
+                req->split = true;
+                req->substation = i;
+                req->loadPos = id;
+            }
+            if (first) {
+                req->state = DemandRequest::ALLOCATED;
+                linkConsumerLoad(slot);
+            }
+        }
+    }
+    for (auto slot : slots)
+        if (requests.get(slot)->state == DemandRequest::CREATED)
+            return false;   // Saved as allocated but carried by no substation
+
+    for (uint64_t k = 0; k < jobTotal; ++k) {
+        const SnapshotJob &r = jobRecs[k];
+        if (r.substation >= h->substationCount || r.state > MaintenanceJob::DONE)
+            return false;
+        MaintenanceJob job(r.substation, time_t(r.startTime), time_t(r.endTime));
+        job.state = MaintenanceJob::State(r.state);
+        if (k < h->jobCount) maintenanceJobs.emplace(size_t(r.jobID), job);
+        else maintenanceHistory.push_back(job);
+    }
+    for (uint32_t k = 0; k < h->eventCount; ++k) {
+        if (!maintenanceJobs.count(size_t(eventRecs[k].jobID)))
+            return false;
+        maintenanceEvents.push({time_t(eventRecs[k].at), size_t(eventRecs[k].jobID),
+                                eventRecs[k].start != 0});
+    }
+    nextSeq.store(h->nextSeq, memory_order_relaxed);
+    drainSeq = h->nextSeq;
+    nextJobID = size_t(h->nextJobID);
+    journalLSN = durableSnapshotLSN = h->journalLSN;
+    splitMinMW = isfinite(h->splitMinMW) ? max(0.0, h->splitMinMW) : 0;
+    setRetryHorizon(h->retryHorizon, h->agingStep);
+    err.clear();
+    return true;
+}
+
+//----------- Journal.cpp -----------
+template <class Policies>
+inline long long BasicGridController<Policies>::replayJournal(const string &path, string &err) {
+    if (journal) {
+        err = "journal already open";
+        return -1;
+    }
+    long long applied = 0;
+    bool batch = batchPacking;   // Each BALANCE carries its own packing; it does not persist
+    for (int part = 0; part < 2; ++part) {
+        bool current = part == 1;
+        string file = current ? path : path + ".old";
+        int fd = open(file.c_str(), O_RDONLY);
+        if (fd < 0) {
+            if (errno == ENOENT) continue;   // Nothing journaled there yet
+            err = file + ": " + strerror(errno);
+            return -1;
+        }
+        struct stat stbuf;
+        if (fstat(fd, &stbuf) != 0) {
+            err = file + ": " + strerror(errno);
+            close(fd);
+            return -1;
+        }
+        size_t len = size_t(stbuf.st_size);
+        if (len == 0) { close(fd); continue; }
+        void *map = mmap(nullptr, len, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (map == MAP_FAILED) { err = file + ": " + strerror(errno); return -1; }
+        madvise(map, len, MADV_SEQUENTIAL);
+        unique_ptr<void, function<void(void*)>> unmap(map, [len](void *m) { munmap(m, len); });
+        const char *base = static_cast<const char*>(map);
+
+        size_t pos = 0;
+        uint64_t last = 0;
+        while (len - pos >= sizeof(JournalRecord)) {
+            JournalRecord r;
+            memcpy(&r, base + pos, sizeof(r));
+            size_t padded = (size_t(r.nameLen) + 7) & ~size_t(7);
+            if (padded > len - pos - sizeof(r)) break;
+            string_view payload(base + pos + sizeof(r), r.nameLen);
+            if (journalChecksum(r, payload) != r.check) break;
+            pos += sizeof(r) + padded;
+            last = r.lsn;
+            if (r.lsn <= journalLSN) continue;   // Already in the restored snapshot
+            if (r.lsn != journalLSN + 1) {
+                err = file + ": journal does not continue from LSN " + to_string(journalLSN);
+                return -1;
+            }
+            journalLSN = r.lsn;
+            ++applied;
+            switch (r.type) {
+            case JournalRecord::NAME: {
+                lock_guard<mutex> lk(consumerNamesMutex);
+                if (consumerNames.intern(payload) != r.id) {
+                    err = file + ": consumer ids do not match the starting state";
+                    return -1;
+                }
+                break;
+            }
+            case JournalRecord::REPORT: {
+                const DemandClassInfo *cls = findDemandClassByPriority(r.priority);
+                if (!cls || r.id >= consumerNames.size()) {
+                    err = file + ": bad report at LSN " + to_string(r.lsn);
+                    return -1;
+                }
+                enqueueRecord({r.megawatts, r.t0, uint64_t(r.t1), r.id, r.zone, cls->make});
+                if (uint64_t(r.t1) >= nextSeq.load(memory_order_relaxed))
+                    nextSeq.store(uint64_t(r.t1) + 1, memory_order_relaxed);
+                drainSeq = max(drainSeq, uint64_t(r.t1) + 1);
+                break;
+            }
+            case JournalRecord::RELEASE: {
+                double mw;
+                releaseDemand(r.id, mw);
+                break;
+            }
+            case JournalRecord::MAINTENANCE:
+                if (!scheduleMaintenance(r.id, time_t(r.t0), time_t(r.t1))) {
+                    err = file + ": unknown substation at LSN " + to_string(r.lsn);
+                    return -1;
+                }
+                break;
+            case JournalRecord::BALANCE:
+                if (r.policy > uint8_t(AllocPolicy::SCAN_BEST)) {
+                    err = file + ": bad balance at LSN " + to_string(r.lsn);
+                    return -1;
+                }
+                setBatchPacking(r.flags & kJournalBatch);
+                setRetryHorizon(r.priority, r.zone);
+                runScheduler(AllocPolicy(r.policy),
+                             (r.flags & kJournalFull) ? BalanceMode::FULL : BalanceMode::INCREMENTAL,
+                             time_t(r.t0));
+                break;
+            case JournalRecord::SPLIT:
+                setSplitAllocation(r.megawatts);
+                break;
+            default:
+                err = file + ": unknown record type at LSN " + to_string(r.lsn);
+                return -1;
+            }
+        }
+        if (pos != len) {
+            // Only the live file may end in a torn write from a crash
+            if (!current) {
+                err = file + ": corrupt record at offset " + to_string(pos);
+                return -1;
+            }
+            if (truncate(file.c_str(), off_t(pos)) != 0) {
+                err = file + ": " + strerror(errno);
+                return -1;
+            }
+        }
+        if (!current) journalOldLSN = last;
+    }
+    batchPacking = batch;
+    lock_guard<mutex> lk(consumerNamesMutex);
+    journaledNames = uint32_t(consumerNames.size());
+    return applied;
+}
+
+//----------- BackgroundScheduler.h -----------
+// Runs ticks on its own thread: every 'cadence' on the monotonic clock, early
+// once 'depth' demands are pending (0 = never), and as soon as a maintenance
+// edge falls due. Every tick, and every other use of the controller, must hold
+// 'control'; receiveDemand() alone is safe without it.
+class BackgroundScheduler {
+    using Clock = chrono::steady_clock;
+    static constexpr chrono::milliseconds kPollInterval{5};   // Depth / maintenance check rate
+
+    GridController &grid;
+    mutex &control;
+    chrono::milliseconds cadence;
+    size_t depth;
+    AllocPolicy policy;
+    BalanceMode mode;
+    mutex m;
+    condition_variable cv;
+    bool stopping = false;
+    atomic<uint64_t> ticks{0};
+    thread worker;
+
+    void run() {
+        Clock::time_point next = Clock::now() + cadence;
+        unique_lock<mutex> lk(m);
+        while (!cv.wait_until(lk, min(next, Clock::now() + kPollInterval), [&] { return stopping; })) {
+            lk.unlock();
+            {
+                lock_guard<mutex> g(control);
+                time_t edge;
+                bool due = Clock::now() >= next
+                        || (depth && grid.pendingCount() >= depth)
+                        || (grid.nextMaintenanceEdge(edge) && edge <= grid.now());
+                if (due) {
+                    grid.runScheduler(policy, mode);
+                    ticks.fetch_add(1, memory_order_relaxed);
+                    next = Clock::now() + cadence;
+                }
+            }
+            lk.lock();
+        }
+    }
+
+public:
+    BackgroundScheduler(GridController &g, mutex &controlMutex, chrono::milliseconds every,
+                        size_t depthThreshold = 0, AllocPolicy p = AllocPolicy::FIRST_FIT,
+                        BalanceMode md = BalanceMode::INCREMENTAL)
+      : grid(g), control(controlMutex), cadence(max(every, chrono::milliseconds(1))),
+        depth(depthThreshold), policy(p), mode(md) {
+        worker = thread([this] { run(); });
+    }
+    BackgroundScheduler(const BackgroundScheduler &) = delete;
+    BackgroundScheduler &operator=(const BackgroundScheduler &) = delete;
+
+    ~BackgroundScheduler() {
+        {
+            lock_guard<mutex> lk(m);
+            stopping = true;
+        }
+        cv.notify_one();
+        worker.join();
+    }
+
+    uint64_t tickCount() const { return ticks.load(memory_order_relaxed); }
+    chrono::milliseconds interval() const { return cadence; }
+    size_t depthThreshold() const { return depth; }
+};
+
+//----------- BatchIngest.h -----------
+// Splits a file descriptor into lines over one large read() buffer. Returned
+// views point into the buffer and stay valid until the next call to next().
+class LineReader {
+    int fd;
+    vector<char> buf;
+    size_t begin = 0, end = 0;   // Unconsumed bytes are buf[begin, end)
+    bool eof = false;
+public:
+    explicit LineReader(int f, size_t bufSize = size_t(1) << 20) : fd(f), buf(bufSize) {}
+
+    // Fetch the next line without its terminator; false once input is exhausted
+    bool next(string_view &line) {
+        while (true) {
+            const char *p = static_cast<const char*>(memchr(buf.data() + begin, '\n', end - begin));
+            if (p) {
+                line = string_view(buf.data() + begin, size_t(p - (buf.data() + begin)));
+                begin = size_t(p - buf.data()) + 1;
+                return true;
+            }
+            if (eof) {
+                if (begin == end) return false;
+                line = string_view(buf.data() + begin, end - begin);  // Unterminated last line
+                begin = end;
+                return true;
+            }
+            // Slide the partial line to the front, growing if one line fills the buffer
+            if (begin > 0) {
+                memmove(buf.data(), buf.data() + begin, end - begin);
+                end -= begin;
+                begin = 0;
+            }
+            if (end == buf.size()) buf.resize(buf.size() * 2);
+            ssize_t n = ::read(fd, buf.data() + end, buf.size() - end);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) eof = true;
+            else end += size_t(n);
+        }
+    }
+};
+
+// Pop the next whitespace-separated token off the front of 'rest'
+inline bool nextToken(string_view &rest, string_view &tok) {
+    size_t i = 0, n = rest.size();
+    while (i < n && (rest[i] == ' ' || rest[i] == '\t' || rest[i] == '\r')) ++i;
+    size_t j = i;
+    while (j < n && rest[j] != ' ' && rest[j] != '\t' && rest[j] != '\r') ++j;
+    tok = rest.substr(i, j - i);
+    rest.remove_prefix(j);
+    return !tok.empty();
+}
+
+// Parse a whole token as a number; false on trailing garbage
+template <class T>
+inline bool parseNumber(string_view tok, T &out) {
+    auto res = from_chars(tok.data(), tok.data() + tok.size(), out);
+    return res.ec == errc() && res.ptr == tok.data() + tok.size();
+}
+
+// Split 's' at the first 'sep'; false if there is none
+inline bool splitOnce(string_view s, char sep, string_view &a, string_view &b) {
+    size_t p = s.find(sep);
+    if (p == string_view::npos) return false;
+    a = s.substr(0, p);
+    b = s.substr(p + 1);
+    return true;
+}
+
+// Parse "lo:hi" with lo <= hi
+inline bool parseRange(string_view s, double &lo, double &hi) {
+    string_view a, b;
+    return splitOnce(s, ':', a, b) && parseNumber(a, lo) && parseNumber(b, hi) && lo <= hi;
+}
+
+// Parse "res:com:ind" class weights; non-negative, not all zero
+inline bool parseMix(string_view s, double (&mix)[3]) {
+    string_view a, b, c;
+    return splitOnce(s, ':', a, b) && splitOnce(b, ':', b, c)
+           && parseNumber(a, mix[0]) && parseNumber(b, mix[1]) && parseNumber(c, mix[2])
+           && mix[0] >= 0 && mix[1] >= 0 && mix[2] >= 0 && mix[0] + mix[1] + mix[2] > 0;
+}
+
+// Counters reported at the end of a batch run
+struct IngestStats {
+    size_t lines = 0;        // Non-blank, non-comment lines seen
+    size_t reports = 0;      // Demand records accepted
+    size_t maintenance = 0;  // Maintenance records accepted
+    size_t balances = 0;     // Balance ticks run
+    size_t releases = 0;     // Release records accepted
+    size_t rejected = 0;     // Malformed or unknown records
+};
+
+// Feed 'report', 'maintenance', 'release' and 'balance' records from 'fd' into the grid.
+// A report may carry a trailing zone id. Lines starting with '#' are comments.
+// Nothing is printed per record.
+inline IngestStats ingestStream(GridController &grid, int fd) {
+    IngestStats st;
+    LineReader reader(fd);
+    size_t zones = grid.regionCount();
+    string_view line, cmd, a, b, c;
+    while (reader.next(line)) {
+        if (!nextToken(line, cmd) || cmd[0] == '#') continue;
+        ++st.lines;
+        if (cmd == "report") {
+            double mw;
+            uint16_t zone = 0;
+            string_view z;
+            const DemandClassInfo *cls;
+            if (nextToken(line, a) && nextToken(line, b) && nextToken(line, c)
+                && (cls = findDemandClass(b)) && parseNumber(c, mw) && mw > 0
+                && (!nextToken(line, z) || parseNumber(z, zone)) && zone < zones) {
+                cls->submit(grid, grid.consumerId(a), mw, grid.nowNanos(), zone);
+                ++st.reports;
+                continue;
+            }
+        } else if (cmd == "maintenance") {
+            long delaySec;
+            if (nextToken(line, a) && nextToken(line, b) && parseNumber(b, delaySec)) {
+                time_t now = grid.now();
+                if (grid.scheduleMaintenance(a, now + delaySec, now + delaySec + 3600)) {
+                    ++st.maintenance;
+                    continue;
+                }
+            }
+        } else if (cmd == "release") {
+            double mw;
+            if (nextToken(line, a)) {
+                grid.releaseDemand(a, mw);
+                ++st.releases;
+                continue;
+            }
+        } else if (cmd == "balance") {
+            AllocPolicy policy = AllocPolicy::FIRST_FIT;
+            if (!nextToken(line, a) || parseAllocPolicy(string(a), policy)) {
+                grid.runScheduler(policy);
+                ++st.balances;
+                continue;
+            }
+        }
+        ++st.rejected;
+    }
+    return st;
+}
+
+//----------- DemandLog.h -----------
+// Compact binary demand log: a header, fixed-width records, then the consumer
+// name table. Records refer to consumers by index into that table so replay
+// never parses text. All integers are in host byte order.
+struct DemandLogHeader {
+    char magic[8];          // "SGDLOG1" plus NUL
+    uint32_t version;       // Format version, currently 1
+    uint32_t nameCount;     // Entries in the consumer name table
+    uint64_t recordCount;   // DemandLogRecord entries following the header
+    uint64_t namesOffset;   // File offset of uint32_t offsets[nameCount + 1] then name bytes
+};
+
+struct DemandLogRecord {
+    uint32_t consumer;      // Index into the log's name table
+    uint8_t priority;       // Demand class tag (DemandClassInfo::priority)
+    uint8_t pad;
+    uint16_t region;        // Transmission zone
+    double megawatts;
+    int64_t timestamp;      // Arrival time, ns on the monotonic clock
+};
+static_assert(sizeof(DemandLogRecord) == 24, "DemandLogRecord must stay fixed-width");
+
+static const char kDemandLogMagic[8] = {'S', 'G', 'D', 'L', 'O', 'G', '1', '\0'};
+
+// Streams records to a log file; the name table is appended by finish()
+class DemandLogWriter {
+    FILE *out = nullptr;
+    vector<char> iobuf = vector<char>(size_t(1) << 20);
+    unordered_map<string, uint32_t> ids;
+    vector<string> names;
+    uint64_t records = 0;
+public:
+    bool open(const char *path) {
+        out = fopen(path, "wb");
+        if (!out) return false;
+        setvbuf(out, iobuf.data(), _IOFBF, iobuf.size());
+        DemandLogHeader h = {};
+        return fwrite(&h, sizeof(h), 1, out) == 1;   // Placeholder until finish()
+    }
+
+    void append(string_view consumer, int priority, double mw, int64_t ts, uint16_t zone) {
+        auto it = ids.find(string(consumer));
+        if (it == ids.end()) {
+            it = ids.emplace(string(consumer), uint32_t(names.size())).first;
+            names.emplace_back(consumer);
+        }
+        DemandLogRecord r = {};
+        r.consumer = it->second;
+        r.priority = uint8_t(priority);
+        r.region = zone;
+        r.megawatts = mw;
+        r.timestamp = ts;
+        fwrite(&r, sizeof(r), 1, out);
+        ++records;
+    }
+
+    // Write the name table, patch the header and close; false on I/O error
+    bool finish() {
+        DemandLogHeader h = {};
+        memcpy(h.magic, kDemandLogMagic, sizeof(h.magic));
+        h.version = 1;
+        h.nameCount = uint32_t(names.size());
+        h.recordCount = records;
+        h.namesOffset = sizeof(h) + records * sizeof(DemandLogRecord);
+        uint32_t off = 0;
+        for (auto &n : names) {
+            fwrite(&off, sizeof(off), 1, out);
+            off += uint32_t(n.size());
+        }
+        fwrite(&off, sizeof(off), 1, out);
+        for (auto &n : names) fwrite(n.data(), 1, n.size(), out);
+        bool ok = fseek(out, 0, SEEK_SET) == 0 && fwrite(&h, sizeof(h), 1, out) == 1;
+        ok = (fclose(out) == 0) && ok;
+        out = nullptr;
+        return ok;
+    }
+
+    uint64_t recordCount() const { return records; }
+};
+
+// Convert the 'report' lines of a text stream into a binary log; returns records written
+inline bool convertToDemandLog(int fd, const char *outPath, uint64_t &written) {
+    DemandLogWriter w;
+    if (!w.open(outPath)) return false;
+    LineReader reader(fd);
+    string_view line, cmd, a, b, c;
+    while (reader.next(line)) {
+        double mw;
+        uint16_t zone = 0;
+        string_view z;
+        const DemandClassInfo *cls;
+        if (nextToken(line, cmd) && cmd == "report" && nextToken(line, a) && nextToken(line, b)
+            && nextToken(line, c) && (cls = findDemandClass(b)) && parseNumber(c, mw) && mw > 0
+            && (!nextToken(line, z) || parseNumber(z, zone)))
+            w.append(a, cls->priority, mw, monotonicNanos(), zone);
+    }
+    written = w.recordCount();
+    return w.finish();
+}
+
+// Map a binary log and feed every record straight into receiveDemand. Records
+// with an unknown class, consumer or zone, or a non-finite or non-positive MW,
+// are skipped and counted in 'rejected'. Returns the number of records
+// replayed, or -1 with 'err' set.
+inline long long replayDemandLog(GridController &grid, const char *path, uint64_t &rejected,
+                                 string &err) {
+    rejected = 0;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) { err = strerror(errno); return -1; }
+    struct stat stbuf;
+    if (fstat(fd, &stbuf) != 0 || size_t(stbuf.st_size) < sizeof(DemandLogHeader)) {
+        close(fd);
+        err = "file too small for a demand log";
+        return -1;
+    }
+    size_t len = size_t(stbuf.st_size);
+    void *map = mmap(nullptr, len, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) { err = strerror(errno); return -1; }
+    madvise(map, len, MADV_SEQUENTIAL);
+
+    const char *base = static_cast<const char*>(map);
+    const auto *h = reinterpret_cast<const DemandLogHeader*>(base);
+    if (memcmp(h->magic, kDemandLogMagic, sizeof(kDemandLogMagic)) != 0 || h->version != 1
+        || h->recordCount > (len - sizeof(*h)) / sizeof(DemandLogRecord)
+        || h->namesOffset != sizeof(*h) + h->recordCount * sizeof(DemandLogRecord)) {
+        munmap(map, len);
+        err = "not a valid demand log";
+        return -1;
+    }
+
+    // Resolve the name table and class tags once, up front
+    vector<uint32_t> consumers;
+    size_t pos = h->namesOffset;
+    if (!readSnapshotNames(base, len, pos, h->nameCount,
+                           [&](string_view id) { consumers.push_back(grid.consumerId(id)); })) {
+        munmap(map, len);
+        err = "name table out of bounds";
+        return -1;
+    }
+    const DemandClassInfo *byTag[256];
+    for (int t = 0; t < 256; ++t) byTag[t] = findDemandClassByPriority(t);
+
+    const auto *rec = reinterpret_cast<const DemandLogRecord*>(base + sizeof(*h));
+    long long replayed = 0;
+    size_t zones = grid.regionCount();
+    for (uint64_t i = 0; i < h->recordCount; ++i) {
+        const DemandLogRecord &r = rec[i];
+        const DemandClassInfo *cls = byTag[r.priority];
+        if (!cls || r.consumer >= h->nameCount || r.region >= zones
+            || !(isfinite(r.megawatts) && r.megawatts > 0)) {
+            ++rejected;
+            continue;
+        }
+        cls->submit(grid, consumers[r.consumer], r.megawatts, r.timestamp, r.region);
+        ++replayed;
+    }
+    munmap(map, len);
+    return replayed;
+}
+
+//----------- TopologyFile.h -----------
+// Grid topology on disk. The source is CSV, one substation per line:
+//   id,capacity_mw[,region[,feeder_limit_mw]]
+// with '#' comments and an optional header line. Parsing dominates startup on
+// a large grid, so the loader can keep a binary cache beside it: a header with
+// the CSV's size and mtime, fixed-width records in id order, then the id table
+// in the snapshot name-table layout.
+struct TopologyCacheHeader {
+    char magic[8];            // kTopologyCacheMagic
+    uint32_t version;         // 1
+    uint32_t count;           // Substations
+    uint64_t sourceSize;      // CSV size when the cache was written
+    int64_t sourceMtimeNs;    // CSV modification time, ns
+};
+
+struct TopologyCacheRecord {
+    double capacityMW;
+    double feederLimitMW;     // HUGE_VAL when the CSV gives none
+    uint16_t zone;
+    uint8_t pad[6];
+};
+static_assert(sizeof(TopologyCacheRecord) == 24, "TopologyCacheRecord must stay fixed-width");
+
+static const char kTopologyCacheMagic[8] = {'S', 'G', 'T', 'O', 'P', 'O', '1', '\0'};
+
+// Parse topology CSV from 'fd' into 't'; false with 'err' naming the bad line
+inline bool parseTopologyCsv(int fd, GridTopology &t, string &err) {
+    auto trim = [](string_view f) {
+        while (!f.empty() && (f.front() == ' ' || f.front() == '\t')) f.remove_prefix(1);
+        while (!f.empty() && (f.back() == ' ' || f.back() == '\t' || f.back() == '\r')) f.remove_suffix(1);
+        return f;
+    };
+    LineReader reader(fd);
+    string_view line;
+    size_t lineNo = 0;
+    bool first = true;
+    while (reader.next(line)) {
+        ++lineNo;
+        line = trim(line);
+        if (line.empty() || line[0] == '#') continue;
+        string_view f[4];
+        size_t n = 0;
+        for (;;) {
+            size_t comma = line.find(',');
+            if (n == 4) { n = 5; break; }
+            f[n++] = trim(line.substr(0, comma));
+            if (comma == string_view::npos) break;
+            line.remove_prefix(comma + 1);
+        }
+        double cap, feeder = HUGE_VAL;
+        uint16_t zone = 0;
+        bool ok = n >= 2 && n <= 4 && !f[0].empty() && parseNumber(f[1], cap) && cap >= 0
+                  && (n < 3 || f[2].empty() || parseNumber(f[2], zone))
+                  && (n < 4 || f[3].empty() || (parseNumber(f[3], feeder) && feeder >= 0));
+        if (!ok && first && n >= 2 && !parseNumber(f[1], cap)) {   // Header line
+            first = false;
+            continue;
+        }
+        first = false;
+        if (!ok) {
+            err = "line " + to_string(lineNo) + ": expected id,capacity_mw[,region[,feeder_limit_mw]]";
+            return false;
+        }
+        t.ids.emplace_back(f[0]);
+        t.capacityMW.push_back(cap);
+        t.zone.push_back(zone);
+        t.feederLimitMW.push_back(feeder);
+    }
+    return true;
+}
+
+// Load 'path' if it is a cache written from a source with 'src's size and
+// mtime; false if it is missing, stale or damaged
+inline bool readTopologyCache(const string &path, const struct stat &src, GridTopology &t) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+    struct stat stbuf;
+    if (fstat(fd, &stbuf) != 0 || size_t(stbuf.st_size) < sizeof(TopologyCacheHeader)) {
+        close(fd);
+        return false;
+    }
+    size_t len = size_t(stbuf.st_size);
+    void *map = mmap(nullptr, len, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return false;
+    madvise(map, len, MADV_SEQUENTIAL);
 
-    DemandRequest(string cid, double mw)
-      : consumerID(cid), megawatts(mw), timestamp(time(nullptr)), state(CREATED) {}
+    const char *base = static_cast<const char*>(map);
+    const auto *h = reinterpret_cast<const TopologyCacheHeader*>(base);
+    size_t pos = sizeof(*h) + size_t(h->count) * sizeof(TopologyCacheRecord);
+    bool ok = memcmp(h->magic, kTopologyCacheMagic, sizeof(h->magic)) == 0 && h->version == 1
+              && h->sourceSize == uint64_t(src.st_size)
+              && h->sourceMtimeNs == int64_t(src.st_mtim.tv_sec) * 1000000000 + src.st_mtim.tv_nsec
+              && h->count <= (len - sizeof(*h)) / sizeof(TopologyCacheRecord);
+    if (ok) {
+        t.ids.reserve(h->count);
+        ok = readSnapshotNames(base, len, pos, h->count, [&](string_view id) { t.ids.emplace_back(id); });
+    }
+    if (ok) {
+        const auto *rec = reinterpret_cast<const TopologyCacheRecord*>(base + sizeof(*h));
+        t.capacityMW.resize(h->count);
+        t.feederLimitMW.resize(h->count);
+        t.zone.resize(h->count);
+        for (uint32_t i = 0; i < h->count; ++i) {
+            t.capacityMW[i] = rec[i].capacityMW;
+            t.feederLimitMW[i] = rec[i].feederLimitMW;
+            t.zone[i] = rec[i].zone;
+        }
+    }
+    munmap(map, len);
+    if (!ok) t = GridTopology();
+    return ok;
+}
 
-    // Derived classes must define priority: higher means more critical
-    virtual int priority() const = 0;
-    virtual ~DemandRequest() {}
-};
+// Replace 'path' with a cache of 't' for a source with 'src's size and mtime
+inline bool writeTopologyCache(const string &path, const struct stat &src, const GridTopology &t,
+                               string &err) {
+    TopologyCacheHeader h = {};
+    memcpy(h.magic, kTopologyCacheMagic, sizeof(h.magic));
+    h.version = 1;
+    h.count = uint32_t(t.size());
+    h.sourceSize = uint64_t(src.st_size);
+    h.sourceMtimeNs = int64_t(src.st_mtim.tv_sec) * 1000000000 + src.st_mtim.tv_nsec;
+    vector<char> buf;
+    buf.reserve(sizeof(h) + t.size() * (sizeof(TopologyCacheRecord) + 16));
+    appendSnapshotBytes(buf, &h, 1);
+    for (size_t i = 0; i < t.size(); ++i) {
+        TopologyCacheRecord r = {};
+        r.capacityMW = t.capacityMW[i];
+        r.feederLimitMW = t.feederLimitMW[i];
+        r.zone = t.zone[i];
+        appendSnapshotBytes(buf, &r, 1);
+    }
+    appendSnapshotNames(buf, h.count, [&](uint32_t i) -> const string & { return t.ids[i]; });
+    return writeFileReplacing(path, buf, err);
+}
 
-// Residential requests have lowest priority
-class ResidentialRequest : public DemandRequest {
-public:
-    ResidentialRequest(string c, double m): DemandRequest(c,m) {}
-    int priority() const override { return 1; }
-};
-// Commercial requests have medium priority
-class CommercialRequest : public DemandRequest {
-public:
-    CommercialRequest(string c, double m): DemandRequest(c,m) {}
-    int priority() const override { return 2; }
-};
-// Industrial requests have highest priority
-class IndustrialRequest : public DemandRequest {
-public:
-    IndustrialRequest(string c, double m): DemandRequest(c,m) {}
-    int priority() const override { return 3; }
+// Read the topology CSV at 'csvPath', or 'cachePath' instead when it is still
+// fresh. A stale or missing cache is rewritten after parsing; failing to write
+// it only sets 'cacheErr'. False with 'err' set if the CSV cannot be read.
+inline bool loadTopology(const char *csvPath, const char *cachePath, GridTopology &t,
+                         bool &fromCache, string &err, string &cacheErr) {
+    fromCache = false;
+    cacheErr.clear();
+    int fd = open(csvPath, O_RDONLY);
+    struct stat src;
+    if (fd < 0 || fstat(fd, &src) != 0) {
+        err = strerror(errno);
+        if (fd >= 0) close(fd);
+        return false;
+    }
+    if (cachePath && readTopologyCache(cachePath, src, t)) {
+        close(fd);
+        fromCache = true;
+        return true;
+    }
+    bool ok = parseTopologyCsv(fd, t, err);
+    close(fd);
+    if (ok && cachePath) writeTopologyCache(cachePath, src, t, cacheErr);
+    return ok;
+}
+
+//----------- Simulation.h -----------
+// One timed record of a simulation script
+struct SimEvent {
+    enum Kind : uint8_t { REPORT, RELEASE, MAINTENANCE };
+    time_t at;                             // Seconds from the start of the run
+    Kind kind;
+    const DemandClassInfo *cls = nullptr;  // REPORT
+    double megawatts = 0;                  // REPORT
+    uint16_t zone = 0;                     // REPORT
+    time_t duration = 0;                   // MAINTENANCE
+    string target;                         // Consumer, or substation for MAINTENANCE
 };
 
-// Comparator for priority queue: compare by priority then by timestamp (earlier first)
-struct CompareDemand {
-    bool operator()(DemandRequest* a, DemandRequest* b) const {
-        if (a->priority() != b->priority())
-            return a->priority() < b->priority();     // higher priority first
-        return a->timestamp > b->timestamp;           // older requests first
+// Parse a time offset: whole seconds, or with an s, m, h or d suffix
+inline bool parseSimTime(string_view tok, time_t &out) {
+    long unit = 1;
+    if (!tok.empty()) {
+        switch (tok.back()) {
+            case 's': unit = 1; break;
+            case 'm': unit = 60; break;
+            case 'h': unit = 3600; break;
+            case 'd': unit = 86400; break;
+            default: unit = 0;
+        }
+        if (unit) tok.remove_suffix(1);
+        else unit = 1;
+    }
+    long v;
+    if (!parseNumber(tok, v) || v < 0) return false;
+    out = time_t(v) * unit;
+    return true;
+}
+
+// Read a simulation script from 'fd'. Each line is '<time> <record>', the
+// time counted from the start of the run, with records
+//   report <consumerID> <res|com|ind> <MW> [zone]
+//   release <consumerID>
+//   maintenance <subID> [duration]    (default 1h)
+// Lines need not be in time order; records at the same time keep file order.
+// Lines starting with '#' are comments; 'rejected' counts malformed ones.
+inline vector<SimEvent> parseSimulationScript(int fd, size_t &rejected) {
+    vector<SimEvent> events;
+    rejected = 0;
+    LineReader reader(fd);
+    string_view line, t, cmd, a, b, c;
+    while (reader.next(line)) {
+        if (!nextToken(line, t) || t[0] == '#') continue;
+        SimEvent ev;
+        bool ok = parseSimTime(t, ev.at) && nextToken(line, cmd) && nextToken(line, a);
+        if (ok && cmd == "report") {
+            string_view z;
+            ev.kind = SimEvent::REPORT;
+            ok = nextToken(line, b) && nextToken(line, c) && (ev.cls = findDemandClass(b))
+                 && parseNumber(c, ev.megawatts) && ev.megawatts > 0
+                 && (!nextToken(line, z) || parseNumber(z, ev.zone));
+        } else if (ok && cmd == "release") {
+            ev.kind = SimEvent::RELEASE;
+        } else if (ok && cmd == "maintenance") {
+            ev.kind = SimEvent::MAINTENANCE;
+            ev.duration = 3600;
+            ok = !nextToken(line, b) || (parseSimTime(b, ev.duration) && ev.duration > 0);
+        } else {
+            ok = false;
+        }
+        if (!ok) {
+            ++rejected;
+            continue;
+        }
+        ev.target = string(a);
+        events.push_back(move(ev));
     }
+    stable_sort(events.begin(), events.end(),
+                [](const SimEvent &x, const SimEvent &y) { return x.at < y.at; });
+    return events;
+}
+
+struct SimulationConfig {
+    time_t start = 0;        // Virtual wall time of script time 0
+    time_t tick = 0;         // Also tick every 'tick' seconds while work remains (0 = events only)
+    AllocPolicy policy = AllocPolicy::FIRST_FIT;
+    BalanceMode mode = BalanceMode::INCREMENTAL;
 };
 
-//----------- Substation.h -----------
-// Represents a power substation with capacity
-class Substation {
-public:
-    string id;            // Substation identifier
-    double capacityMW;    // Maximum capacity in MW
-    double usedMW = 0;    // Currently allocated MW
-    bool online = true;   // Whether the substation is operational
+struct SimulationStats {
+    size_t events = 0;       // Script records applied
+    size_t rejected = 0;     // ...refused by the grid (unknown substation or zone)
+    size_t ticks = 0;        // Balance ticks run
+    time_t elapsed = 0;      // Virtual seconds covered
+};
 
-    Substation(string i, double cap): id(i), capacityMW(cap) {}
+// Play sorted 'events' against 'grid', whose clock must be 'clock', jumping
+// straight from one instant of interest to the next: script records,
+// maintenance starts and ends, and periodic ticks if configured. Each instant
+// applies its records and then runs one balance tick, so the outcome depends
+// only on the script and the starting state, never on machine speed.
+inline SimulationStats runSimulation(GridController &grid, VirtualClock &clock,
+                                     const vector<SimEvent> &events, const SimulationConfig &cfg) {
+    const time_t never = numeric_limits<time_t>::max();
+    SimulationStats st;
+    time_t nextTick = cfg.tick ? cfg.start + cfg.tick : never;
+    clock.set(cfg.start);
+    size_t i = 0;
+    while (true) {
+        time_t t = i < events.size() ? cfg.start + events[i].at : never;
+        time_t edge;
+        if (grid.nextMaintenanceEdge(edge)) t = min(t, edge);
+        if (t == never) break;             // Periodic ticks alone do not keep the run going
+        t = max(min(t, nextTick), clock.wallTime());
+        clock.set(t);
+        for (; i < events.size() && cfg.start + events[i].at <= t; ++i) {
+            const SimEvent &ev = events[i];
+            double mw;
+            bool ok = true;
+            switch (ev.kind) {
+                case SimEvent::REPORT:
+                    ok = ev.zone < grid.regionCount();
+                    if (ok)
+                        ev.cls->submit(grid, grid.consumerId(ev.target), ev.megawatts,
+                                       grid.nowNanos(), ev.zone);
+                    break;
+                case SimEvent::RELEASE:
+                    grid.releaseDemand(ev.target, mw);
+                    break;
+                case SimEvent::MAINTENANCE:
+                    ok = grid.scheduleMaintenance(ev.target, t, t + ev.duration);
+                    break;
+            }
+            ++(ok ? st.events : st.rejected);
+        }
+        grid.runScheduler(cfg.policy, cfg.mode);
+        ++st.ticks;
+        while (nextTick <= t) nextTick += cfg.tick;
+    }
+    st.elapsed = clock.wallTime() - cfg.start;
+    return st;
+}
 
-    // Returns available capacity if online, else zero
-    double available() const { return online ? capacityMW - usedMW : 0; }
+//----------- Benchmark.h -----------
+// Synthetic workload for timing the scheduler. Parsed from a comma-separated
+// key=value spec, e.g. "subs=8000,demands=1000000,ticks=50,mix=60:30:10,mw=0.5:5".
+struct BenchConfig {
+    size_t subs = 1000;           // Substations in the synthetic grid
+    double capLo = 20, capHi = 200;   // Substation capacity range (MW, uniform)
+    size_t demands = 200000;      // Total demands, spread evenly over the ticks
+    size_t ticks = 20;            // Balance ticks
+    size_t consumers = 50000;     // Distinct consumer ids
+    double mix[3] = {60, 30, 10}; // Residential:commercial:industrial weights
+    double mwLo = 0.5, mwHi = 5;  // Demand size range (MW, uniform)
+    AllocPolicy policy = AllocPolicy::FIRST_FIT;
+    uint64_t seed = 1;
+    size_t regions = 1;           // Zones; substations and demands are spread evenly
+    size_t threads = 0;           // Balancing lanes (0 = controller default)
+    size_t producers = 1;         // Threads calling receiveDemand concurrently
+    BalanceMode mode = BalanceMode::INCREMENTAL;
+    double churn = 0;             // Percent of consumers released before each tick
+    double split = 0;             // Minimum split share in MW (0 = whole allocations only)
+    bool batch = false;           // Batch packing per class instead of arrival order
+    unsigned retry = 0;           // Retry horizon in ticks (0 = shed unplaced demands at once)
+    unsigned aging = 1;           // Priority levels gained per deferred tick
+    string journal;               // Journal file to write while benchmarking ("" = none)
+    bool summary = false;         // Time showSummary instead of the full showStatus
+    vector<pair<AllocPolicy, QueueBackend>> bundles;   // Compiled bundles to compare ("" = none)
 
-    // Try allocate 'mw'; return true if successful
-    bool allocate(double mw) {
-        if (available() >= mw) {
-            usedMW += mw;
+    // Apply 'spec' on top of the defaults; false with 'err' set on a bad key/value
+    bool parse(const string &spec, string &err) {
+        string_view rest(spec);
+        while (!rest.empty()) {
+            size_t comma = rest.find(',');
+            string_view item = rest.substr(0, comma);
+            rest = comma == string_view::npos ? string_view() : rest.substr(comma + 1);
+            size_t eq = item.find('=');
+            if (eq == string_view::npos) { err = "expected key=value: " + string(item); return false; }
+            string_view key = item.substr(0, eq), val = item.substr(eq + 1);
+            bool ok;
+            if (key == "subs") ok = parseNumber(val, subs) && subs > 0;
+            else if (key == "demands") ok = parseNumber(val, demands);
+            else if (key == "ticks") ok = parseNumber(val, ticks) && ticks > 0;
+            else if (key == "consumers") ok = parseNumber(val, consumers) && consumers > 0;
+            else if (key == "seed") ok = parseNumber(val, seed);
+            else if (key == "regions") ok = parseNumber(val, regions) && regions > 0 && regions <= 65536;
+            else if (key == "threads") ok = parseNumber(val, threads);
+            else if (key == "producers") ok = parseNumber(val, producers) && producers > 0;
+            else if (key == "split") ok = parseNumber(val, split) && split >= 0;
+            else if (key == "retry") ok = parseNumber(val, retry) && retry <= 255;
+            else if (key == "aging") ok = parseNumber(val, aging) && aging <= 255;
+            else if (key == "churn") ok = parseNumber(val, churn) && churn >= 0 && churn <= 100;
+            else if (key == "journal") ok = !(journal = string(val)).empty();
+            else if (key == "status") {
+                ok = val == "full" || val == "summary";
+                summary = val == "summary";
+            }
+            else if (key == "pack") {
+                ok = val == "batch" || val == "greedy";
+                batch = val == "batch";
+            }
+            else if (key == "mode") {
+                ok = val == "full" || val == "incremental";
+                mode = val == "full" ? BalanceMode::FULL : BalanceMode::INCREMENTAL;
+            }
+            else if (key == "policy") ok = parseAllocPolicy(string(val), policy);
+            else if (key == "cap") ok = parseRange(val, capLo, capHi);
+            else if (key == "mw") ok = parseRange(val, mwLo, mwHi) && mwLo > 0;
+            else if (key == "mix") ok = parseMix(val, mix);
+            else if (key == "bundles") ok = parseBundles(val);
+            else { err = "unknown key: " + string(key); return false; }
+            if (!ok) { err = "bad value for " + string(key) + ": " + string(val); return false; }
+        }
+        if (!bundles.empty() && !journal.empty()) {
+            err = "bundles and journal cannot be combined";
+            return false;
+        }
+        return true;
+    }
+
+    // "all" or ':'-separated <policy>-<heap|bucket> names, e.g. "first-heap:scan-best-bucket"
+    bool parseBundles(string_view val) {
+        bundles.clear();
+        static const AllocPolicy policies[] = {AllocPolicy::FIRST_FIT, AllocPolicy::BEST_FIT,
+            AllocPolicy::WORST_FIT, AllocPolicy::SCAN_FIRST, AllocPolicy::SCAN_BEST};
+        if (val == "all") {
+            for (QueueBackend q : {QueueBackend::HEAP, QueueBackend::BUCKET})
+                for (AllocPolicy p : policies) bundles.emplace_back(p, q);
             return true;
         }
-        return false;
+        while (!val.empty()) {
+            size_t colon = val.find(':');
+            string_view name = val.substr(0, colon);
+            val = colon == string_view::npos ? string_view() : val.substr(colon + 1);
+            size_t dash = name.rfind('-');
+            AllocPolicy p;
+            if (dash == string_view::npos || !parseAllocPolicy(string(name.substr(0, dash)), p))
+                return false;
+            string_view q = name.substr(dash + 1);
+            if (q != "heap" && q != "bucket") return false;
+            bundles.emplace_back(p, q == "heap" ? QueueBackend::HEAP : QueueBackend::BUCKET);
+        }
+        return !bundles.empty();
     }
+};
 
-    // Deallocate 'mw' from used capacity (not used in current logic but provided)
-    void deallocate(double mw) { usedMW = max(0.0, usedMW - mw); }
+// Nearest-rank percentile of 'v' (p in [0, 100]); v is sorted in place
+inline double percentile(vector<double> &v, double p) {
+    if (v.empty()) return 0;
+    sort(v.begin(), v.end());
+    size_t rank = size_t(ceil(p / 100.0 * double(v.size())));
+    return v[min(v.size() - 1, rank > 0 ? rank - 1 : 0)];
+}
+
+// Swallows output so showStatus can be timed without terminal I/O
+class NullBuffer : public streambuf {
+protected:
+    int overflow(int c) override { return c; }
+    streamsize xsputn(const char *, streamsize n) override { return n; }
 };
 
-//----------- MaintenanceJob.h -----------
-// Represents a scheduled maintenance for a substation
-class MaintenanceJob {
-public:
-    string substationID;
-    time_t startTime;
-    time_t endTime;
-    enum State { SCHEDULED, IN_PROGRESS, DONE } state;
+// Totals and per-tick timings of one benchmark run
+struct BenchResult {
+    vector<double> recvMs, schedMs, statusMs;
+    double recvTotal = 0, schedTotal = 0, statusTotal = 0;
+    size_t received = 0, placed = 0, shed = 0, deferred = 0;
+    double shedMW = 0;
+    size_t memory = 0;            // Controller memoryUsage() at the end
+    bool journalOpened = true;    // False if cfg.journal could not be opened (nothing ran)
+    bool journalSynced = true;    // False if the final sync failed
+    string journalErr;
+    double syncMs = 0;            // Final journal sync
+};
 
-    MaintenanceJob(string sid, time_t st, time_t et)
-      : substationID(sid), startTime(st), endTime(et), state(SCHEDULED) {}
+// Build the synthetic grid on a 'Grid' controller (some BasicGridController)
+// and run the ticks
+template <class Grid>
+inline BenchResult benchmarkController(const BenchConfig &cfg, QueueBackend backend) {
+    BenchResult res;
+    mt19937_64 rng(cfg.seed);
+    Grid grid(backend);
+    if (cfg.threads) grid.setWorkerThreads(cfg.threads);
+    grid.setSplitAllocation(cfg.split);
+    grid.setBatchPacking(cfg.batch);
+    grid.setRetryHorizon(cfg.retry, cfg.aging);
+    if (!cfg.journal.empty() && !grid.openJournal(cfg.journal, res.journalErr)) {
+        res.journalOpened = false;
+        return res;
+    }
+    uniform_real_distribution<double> capDist(cfg.capLo, cfg.capHi);
+    char name[32];
+    for (size_t i = 0; i < cfg.subs; ++i) {
+        snprintf(name, sizeof(name), "S%06zu", i);
+        grid.addSubstation(name, capDist(rng), uint16_t(i % cfg.regions));
+    }
+    vector<uint32_t> consumers(cfg.consumers);
+    for (size_t i = 0; i < cfg.consumers; ++i) {
+        snprintf(name, sizeof(name), "C%07zu", i);
+        consumers[i] = grid.consumerId(name);
+    }
 
-    // Advance job state based on current time
-    void advanceState(time_t now) {
-        if (state == SCHEDULED && now >= startTime)
-            state = IN_PROGRESS;
-        if (state == IN_PROGRESS && now >= endTime)
-            state = DONE;
+    // Pre-generate each tick's demands so generation is not timed
+    struct Gen { uint32_t consumer; uint8_t cls; uint16_t zone; double mw; };
+    discrete_distribution<int> classDist(begin(cfg.mix), end(cfg.mix));
+    uniform_real_distribution<double> mwDist(cfg.mwLo, cfg.mwHi);
+    uniform_int_distribution<size_t> consumerDist(0, cfg.consumers - 1);
+    uniform_int_distribution<size_t> zoneDist(0, cfg.regions - 1);
+    const auto &classes = demandClasses();
+    size_t perTick = cfg.demands / cfg.ticks;
+
+    NullBuffer nullBuf;
+    ostream devNull(&nullBuf);
+    vector<Gen> batch(perTick);
+    using Clock = chrono::steady_clock;
+    auto ms = [](Clock::time_point a, Clock::time_point b) {
+        return chrono::duration<double, milli>(b - a).count();
+    };
+
+    for (size_t t = 0; t < cfg.ticks; ++t) {
+        size_t n = (t + 1 == cfg.ticks) ? cfg.demands - perTick * t : perTick;
+        batch.resize(n);
+        for (auto &g : batch) {
+            g.consumer = consumers[consumerDist(rng)];
+            g.cls = uint8_t(classDist(rng));
+            g.zone = uint16_t(zoneDist(rng));
+            g.mw = mwDist(rng);
+        }
+        int64_t now = grid.nowNanos();
+
+        // Completed load frees capacity so later ticks are not all shedding
+        size_t releases = size_t(double(cfg.consumers) * cfg.churn / 100.0);
+        double freed;
+        for (size_t k = 0; k < releases; ++k)
+            grid.releaseDemand(consumers[consumerDist(rng)], freed);
+
+        auto t0 = Clock::now();
+        if (cfg.producers == 1) {
+            for (auto &g : batch)
+                grid.receiveDemand(classes[g.cls].make, g.consumer, g.mw, now, g.zone);
+        } else {
+            vector<thread> producers;
+            for (size_t p = 0; p < cfg.producers; ++p)
+                producers.emplace_back([&, p] {
+                    for (size_t k = p; k < batch.size(); k += cfg.producers) {
+                        const Gen &g = batch[k];
+                        grid.receiveDemand(classes[g.cls].make, g.consumer, g.mw, now, g.zone);
+                    }
+                });
+            for (auto &th : producers) th.join();
+        }
+        auto t1 = Clock::now();
+        if (cfg.summary) grid.showSummary(devNull);
+        else grid.showStatus(devNull);
+        auto t2 = Clock::now();
+        grid.runScheduler(cfg.policy, cfg.mode);
+        auto t3 = Clock::now();
+
+        res.recvMs.push_back(ms(t0, t1));
+        res.statusMs.push_back(ms(t1, t2));
+        res.schedMs.push_back(ms(t2, t3));
+        res.recvTotal += res.recvMs.back();
+        res.statusTotal += res.statusMs.back();
+        res.schedTotal += res.schedMs.back();
+        res.received += n;
+        res.placed += grid.lastTickDelta().placed;
+        res.shed += grid.lastTickDelta().shed;
+        res.shedMW += grid.lastTickDelta().shedMW;
+        res.deferred += grid.lastTickDelta().deferred;
     }
-};
+    res.memory = grid.memoryUsage();
+    if (!cfg.journal.empty()) {
+        auto t0 = Clock::now();
+        res.journalSynced = grid.syncJournal(res.journalErr);
+        res.syncMs = ms(t0, Clock::now());
+    }
+    return res;
+}
 
-//----------- GridController.h -----------
-// Manages demands, substations, and maintenance
-class GridController {
-    // Priority queue for pending demand requests
-    priority_queue<DemandRequest*, vector<DemandRequest*>, CompareDemand> demandQ;
-    vector<Substation> substations;          // All substations in grid
-    list<MaintenanceJob> maintenanceList;    // Scheduled maintenance jobs
+// Controller with every choice fixed at compile time: policy P, queue Q, system clock
+template <AllocPolicy P, class Q>
+using FixedGridController =
+    BasicGridController<GridPolicies<FixedAllocator<P>, FixedQueue<Q>, FixedSystemClock>>;
 
-public:
-    GridController() {}
+using BenchFn = BenchResult (*)(const BenchConfig &, QueueBackend);
 
-    // Add a substation to the grid
-    void addSubstation(const string &id, double cap) {
-        substations.emplace_back(id, cap);
+template <class Q>
+inline BenchFn fixedBenchmark(AllocPolicy p) {
+    switch (p) {
+    case AllocPolicy::BEST_FIT: return &benchmarkController<FixedGridController<AllocPolicy::BEST_FIT, Q>>;
+    case AllocPolicy::WORST_FIT: return &benchmarkController<FixedGridController<AllocPolicy::WORST_FIT, Q>>;
+    case AllocPolicy::SCAN_FIRST: return &benchmarkController<FixedGridController<AllocPolicy::SCAN_FIRST, Q>>;
+    case AllocPolicy::SCAN_BEST: return &benchmarkController<FixedGridController<AllocPolicy::SCAN_BEST, Q>>;
+    default: return &benchmarkController<FixedGridController<AllocPolicy::FIRST_FIT, Q>>;
     }
+}
 
-    // Enqueue a new demand request
-    void receiveDemand(DemandRequest* req) {
-        req->state = DemandRequest::QUEUED;
-        demandQ.push(req);
+inline const char *allocPolicyName(AllocPolicy p) {
+    static const char *const names[] = {"first", "best", "worst", "scan-first", "scan-best"};
+    return names[size_t(p)];
+}
+
+// Print per-phase timings of the runtime controller or, with 'bundles', run
+// each listed bundle both as the runtime controller set to the same policy and
+// queue and as its compiled FixedGridController, on the same workload
+inline void runBenchmark(const BenchConfig &cfg, QueueBackend backend) {
+    printf("Benchmark: %zu substations in %zu regions, %zu demands over %zu ticks, mix %g:%g:%g, MW %g..%g\n",
+           cfg.subs, cfg.regions, cfg.demands, cfg.ticks, cfg.mix[0], cfg.mix[1], cfg.mix[2],
+           cfg.mwLo, cfg.mwHi);
+    if (!cfg.bundles.empty()) {
+        printf("%-18s %12s %12s %8s %10s %10s %10s %10s\n", "bundle", "runtime ms", "fixed ms",
+               "speedup", "p50 ms", "p99 ms", "placed", "shed");
+        for (auto &b : cfg.bundles) {
+            BenchConfig c = cfg;
+            c.policy = b.first;
+            BenchResult dyn = benchmarkController<GridController>(c, b.second);
+            BenchResult fix = (b.second == QueueBackend::BUCKET ? fixedBenchmark<BucketDemandQueue>(b.first)
+                                                                : fixedBenchmark<HeapDemandQueue>(b.first))(c, b.second);
+            string name = string(allocPolicyName(b.first))
+                        + (b.second == QueueBackend::BUCKET ? "-bucket" : "-heap");
+            printf("%-18s %12.2f %12.2f %7.2fx %10.3f %10.3f %10zu %10zu%s\n", name.c_str(),
+                   dyn.schedTotal, fix.schedTotal, fix.schedTotal > 0 ? dyn.schedTotal / fix.schedTotal : 0.0,
+                   percentile(fix.schedMs, 50), percentile(fix.schedMs, 99), fix.placed, fix.shed,
+                   dyn.placed == fix.placed && dyn.shed == fix.shed ? "" : "  (differs from runtime)");
+        }
+        return;
     }
 
-    // Schedule a maintenance window [start, end)
-    void scheduleMaintenance(const string &sid, time_t start, time_t end) {
-        maintenanceList.emplace_back(sid, start, end);
+    BenchResult r = benchmarkController<GridController>(cfg, backend);
+    if (!r.journalOpened) {
+        fprintf(stderr, "Cannot open journal: %s\n", r.journalErr.c_str());
+        return;
     }
+    printf("%-14s %12s %14s %10s %10s\n", "phase", "total ms", "ops/s", "p50 ms", "p99 ms");
+    auto row = [&](const char *phase, double total, double ops, vector<double> &v) {
+        printf("%-14s %12.2f %14.0f %10.3f %10.3f\n", phase, total,
+               total > 0 ? ops / (total / 1000.0) : 0.0, percentile(v, 50), percentile(v, 99));
+    };
+    row("receiveDemand", r.recvTotal, double(r.received), r.recvMs);
+    row("runScheduler", r.schedTotal, double(r.received), r.schedMs);
+    row("showStatus", r.statusTotal, double(cfg.ticks), r.statusMs);
+    printf("placed: %zu  shed: %zu (%.1f MW)  deferred: %zu  memory: %zu KiB\n",
+           r.placed, r.shed, r.shedMW, r.deferred, r.memory / 1024);
+    if (!cfg.journal.empty())
+        printf("journal: final sync %.3f ms%s%s\n", r.syncMs,
+               r.journalSynced ? "" : "  error: ", r.journalErr.c_str());
+}
 
-    // Core scheduler: update maintenance, allocate demands or shed
-    void runScheduler() {
-        time_t now = time(nullptr);
+//----------- Scenario.h -----------
+// Monte Carlo capacity study: many random demand and maintenance scenarios on
+// one grid, each simulated on its own controller and virtual clock. Parsed from
+// a key=value spec like the benchmark, e.g. "runs=5000,demands=3000,horizon=7d".
+struct ScenarioConfig {
+    size_t runs = 1000;           // Scenarios
+    size_t demands = 1000;        // Random demands per scenario, arrivals uniform over the horizon
+    time_t horizon = 86400;       // Simulated span of one scenario
+    double mix[3] = {60, 30, 10}; // Residential:commercial:industrial weights
+    double mwLo = 0.5, mwHi = 5;  // Demand size range (MW, uniform)
+    time_t holdLo = 3600, holdHi = 8 * 3600;      // Time until a demand is released (uniform)
+    double outage = 10;           // Percent chance that a substation gets a maintenance window
+    time_t outageLo = 3600, outageHi = 4 * 3600;  // Window length (uniform)
+    time_t tick = 0;              // Extra balance cadence, as --sim-tick (0 = events only)
+    AllocPolicy policy = AllocPolicy::FIRST_FIT;
+    uint64_t seed = 1;
+    size_t threads = 0;           // Scenario lanes (0 = all cores)
+    size_t top = 10;              // Substations listed, worst mean shed first
+    string script;                // Script played in every scenario as well ("" = none)
+    // Scheduling settings of the grid the scenarios start from (not spec keys)
+    double splitMinMW = 0;
+    unsigned retryHorizon = 0, agingStep = 1;
+    bool batchPacking = false;
 
-        // 1) Update maintenance jobs and offline substations
-        for (auto &job : maintenanceList) {
-            job.advanceState(now);
-            for (auto &sub : substations) {
-                if (sub.id == job.substationID) {
-                    // Substation offline during maintenance in-progress
-                    sub.online = (job.state != MaintenanceJob::IN_PROGRESS);
-                }
-            }
+    // Apply 'spec' on top of the defaults; false with 'err' set on a bad key/value
+    bool parse(const string &spec, string &err) {
+        string_view rest(spec);
+        while (!rest.empty()) {
+            size_t comma = rest.find(',');
+            string_view item = rest.substr(0, comma);
+            rest = comma == string_view::npos ? string_view() : rest.substr(comma + 1);
+            size_t eq = item.find('=');
+            if (eq == string_view::npos) { err = "expected key=value: " + string(item); return false; }
+            string_view key = item.substr(0, eq), val = item.substr(eq + 1);
+            bool ok;
+            if (key == "runs") ok = parseNumber(val, runs) && runs > 0;
+            else if (key == "demands") ok = parseNumber(val, demands);
+            else if (key == "horizon") ok = parseSimTime(val, horizon) && horizon > 0;
+            else if (key == "mix") ok = parseMix(val, mix);
+            else if (key == "mw") ok = parseRange(val, mwLo, mwHi) && mwLo > 0;
+            else if (key == "hold") ok = parseTimeRange(val, holdLo, holdHi) && holdLo > 0;
+            else if (key == "outage") ok = parseNumber(val, outage) && outage >= 0 && outage <= 100;
+            else if (key == "outage-len") ok = parseTimeRange(val, outageLo, outageHi) && outageLo > 0;
+            else if (key == "tick") ok = parseSimTime(val, tick);
+            else if (key == "policy") ok = parseAllocPolicy(string(val), policy);
+            else if (key == "seed") ok = parseNumber(val, seed);
+            else if (key == "threads") ok = parseNumber(val, threads);
+            else if (key == "top") ok = parseNumber(val, top);
+            else if (key == "script") ok = !(script = string(val)).empty();
+            else { err = "unknown key: " + string(key); return false; }
+            if (!ok) { err = "bad value for " + string(key) + ": " + string(val); return false; }
+        }
+        return true;
+    }
+
+private:
+    static bool parseTimeRange(string_view s, time_t &lo, time_t &hi) {
+        string_view a, b;
+        return splitOnce(s, ':', a, b) && parseSimTime(a, lo) && parseSimTime(b, hi) && lo <= hi;
+    }
+};
+
+// Shed MW of every scenario, kept whole so the percentiles are exact
+struct ScenarioSamples {
+    vector<double> total;             // [run]
+    vector<vector<double>> byClass;   // [index in demandClasses()][run], queue and migration shed
+    vector<double> bySubstation;      // [substation * runs + run], shed by its own maintenance
+};
+
+// Draw one scenario: random demands with their releases and random
+// maintenance windows, merged behind the shared 'base' records
+inline vector<SimEvent> makeScenario(const GridTopology &topo, const vector<uint16_t> &zones,
+                                     const vector<SimEvent> &base, const ScenarioConfig &cfg,
+                                     mt19937_64 &rng) {
+    const vector<DemandClassInfo> &classes = demandClasses();
+    uniform_int_distribution<time_t> atDist(0, cfg.horizon - 1);
+    uniform_int_distribution<time_t> holdDist(cfg.holdLo, cfg.holdHi);
+    uniform_int_distribution<time_t> lenDist(cfg.outageLo, cfg.outageHi);
+    uniform_int_distribution<size_t> zoneDist(0, zones.size() - 1);
+    uniform_real_distribution<double> mwDist(cfg.mwLo, cfg.mwHi);
+    uniform_real_distribution<double> pctDist(0, 100);
+    discrete_distribution<int> classDist(begin(cfg.mix), end(cfg.mix));
+
+    vector<SimEvent> events(base);
+    events.reserve(base.size() + 2 * cfg.demands + topo.size());
+    char name[32];
+    for (size_t k = 0; k < cfg.demands; ++k) {
+        snprintf(name, sizeof(name), "M%07zu", k);
+        SimEvent r;
+        r.at = atDist(rng);
+        r.kind = SimEvent::REPORT;
+        r.cls = &classes[size_t(classDist(rng))];
+        r.megawatts = mwDist(rng);
+        r.zone = zones[zoneDist(rng)];
+        r.target = name;
+        time_t release = r.at + holdDist(rng);
+        events.push_back(move(r));
+        if (release < cfg.horizon) {
+            SimEvent d;
+            d.at = release;
+            d.kind = SimEvent::RELEASE;
+            d.target = name;
+            events.push_back(move(d));
+        }
+    }
+    for (size_t i = 0; i < topo.size(); ++i) {
+        if (pctDist(rng) >= cfg.outage) continue;
+        SimEvent m;
+        m.at = atDist(rng);
+        m.kind = SimEvent::MAINTENANCE;
+        m.duration = lenDist(rng);
+        m.target = topo.ids[i];
+        events.push_back(move(m));
+    }
+    stable_sort(events.begin(), events.end(),
+                [](const SimEvent &x, const SimEvent &y) { return x.at < y.at; });
+    return events;
+}
+
+// Simulate cfg.runs scenarios on 'topo' across 'lanes' threads. Every scenario
+// gets a private controller built from the shared topology and an rng seeded
+// from its run number alone, so results do not depend on the lane count.
+inline ScenarioSamples runScenarios(const GridTopology &topo, const vector<SimEvent> &base,
+                                    const ScenarioConfig &cfg, QueueBackend backend, size_t lanes) {
+    static constexpr size_t kScenarioIntake = size_t(1) << 12;   // Small ring; bursts spill
+    const vector<DemandClassInfo> &classes = demandClasses();
+    vector<uint16_t> zones(topo.zone);
+    sort(zones.begin(), zones.end());
+    zones.erase(unique(zones.begin(), zones.end()), zones.end());
+    if (zones.empty()) zones.push_back(0);
+
+    ScenarioSamples out;
+    out.total.assign(cfg.runs, 0);
+    out.byClass.assign(classes.size(), vector<double>(cfg.runs, 0));
+    out.bySubstation.assign(topo.size() * cfg.runs, 0);
+
+    ThreadPool pool(lanes - 1);
+    pool.parallelFor(cfg.runs, [&](size_t run) {
+        mt19937_64 rng(cfg.seed + 0x9e3779b97f4a7c15ULL * (run + 1));
+        vector<SimEvent> events = makeScenario(topo, zones, base, cfg, rng);
+
+        GridController grid(backend, kScenarioIntake);
+        grid.setWorkerThreads(1);   // Scenarios already fill the cores
+        grid.setSplitAllocation(cfg.splitMinMW);
+        grid.setRetryHorizon(cfg.retryHorizon, cfg.agingStep);
+        grid.setBatchPacking(cfg.batchPacking);
+        grid.addTopology(topo);
+        VirtualClock clock;
+        grid.setClock(clock);
+        SimulationConfig sc;
+        sc.tick = cfg.tick;
+        sc.policy = cfg.policy;
+        runSimulation(grid, clock, events, sc);
+
+        for (size_t c = 0; c < classes.size(); ++c) {
+            double mw = grid.shedByClass(classes[c].priority).megawatts;
+            out.byClass[c][run] = mw;
+            out.total[run] += mw;
+        }
+        for (size_t i = 0; i < topo.size(); ++i)
+            out.bySubstation[i * cfg.runs + run] = grid.maintenanceShedAt(uint32_t(i));
+    });
+    return out;
+}
+
+// Print the shed-MW distributions: overall, per class, worst substations
+inline void printScenarioReport(const ScenarioSamples &s, const GridTopology &topo,
+                                const ScenarioConfig &cfg) {
+    auto row = [&](const string &label, vector<double> v) {
+        double sum = 0;
+        size_t hit = 0;
+        for (double x : v) { sum += x; hit += x > 0; }
+        double mean = v.empty() ? 0 : sum / double(v.size());
+        printf("  %-14s %10.1f %10.1f %10.1f %10.1f %10.1f %7.1f%%\n", label.c_str(), mean,
+               percentile(v, 50), percentile(v, 95), percentile(v, 99), percentile(v, 100),
+               v.empty() ? 0.0 : 100.0 * double(hit) / double(v.size()));
+    };
+    printf("%-16s %10s %10s %10s %10s %10s %8s\n", "Shed MW", "mean", "p50", "p95", "p99", "max", "P(shed)");
+    row("total", s.total);
+    const vector<DemandClassInfo> &classes = demandClasses();
+    for (size_t c = classes.size(); c-- > 0; )
+        row(classes[c].code, s.byClass[c]);
+
+    vector<pair<double, size_t>> worst;
+    for (size_t i = 0; i < topo.size(); ++i) {
+        const double *v = &s.bySubstation[i * cfg.runs];
+        double sum = accumulate(v, v + cfg.runs, 0.0);
+        if (sum > 0) worst.push_back({sum, i});
+    }
+    sort(worst.begin(), worst.end(), [](auto &a, auto &b) { return a.first > b.first; });
+    if (worst.size() > cfg.top) worst.resize(cfg.top);
+    printf("Shed by own maintenance, %zu worst of %zu substations:\n", worst.size(), topo.size());
+    for (auto &w : worst) {
+        const double *v = &s.bySubstation[w.second * cfg.runs];
+        row(topo.ids[w.second], vector<double>(v, v + cfg.runs));
+    }
+}
+
+//----------- DemandServer.h -----------
+// TCP front end with one epoll loop per core. Each loop has its own
+// SO_REUSEPORT listener, so the kernel spreads new connections across loops and
+// a connection stays on one thread. The protocol is one request per line and
+// one reply per request, in order, with pipelining allowed:
+//   report <consumerID> <res|com|ind> <MW> [zone]   -> "ok"
+//   release <consumerID>                            -> "released <count> <MW>"
+//   status                                          -> summary lines, then "."
+// Anything else gets "err <reason>". Reports parsed in one wakeup go to the
+// intake as one batch, releases and status share one hold of 'control', and
+// each connection's replies go out in a single sendmsg. With a journal, a
+// wakeup's replies go out only once its reports are on disk, so "ok" means
+// durable; a client whose reports could not be journaled is disconnected.
+class DemandServer {
+    static constexpr size_t kMaxLine = 4096;          // Longer lines close the connection
+    static constexpr size_t kReadChunk = 64 * 1024;
+    static constexpr size_t kMaxBacklog = 1 << 20;    // Unsent reply bytes before reads pause
+    static constexpr size_t kChunk = 4096;            // Short replies coalesce up to this
+    static constexpr int kMaxEvents = 256;
+
+    struct Connection {
+        int fd;
+        string in;                 // Bytes received but not yet parsed
+        deque<string> out;         // Reply chunks not yet sent
+        size_t outOffset = 0;      // Bytes of out.front() already sent
+        size_t backlog = 0;        // Unsent reply bytes
+        uint32_t events = 0;       // Current epoll interest
+        bool reported = false;     // Got an "ok" this wakeup that awaits the journal
+    };
+
+    struct Loop {
+        int listenFd = -1;
+        int epollFd = -1;
+        int wakeFd = -1;           // eventfd written to stop the loop
+        unordered_map<int, unique_ptr<Connection>> conns;
+        vector<IntakeRecord> batch;        // Reports parsed this wakeup
+        uint64_t lastSeq = 0;              // Highest sequence pushed this wakeup
+        bool pushed = false;               // Whether any report was pushed this wakeup
+        vector<Connection*> dirty;         // Connections with replies to flush
+        thread worker;
+    };
+
+    GridController &grid;
+    mutex &control;
+    size_t zones = 0;              // Valid report zones, fixed when serving starts
+    uint16_t boundPort = 0;
+    vector<unique_ptr<Loop>> loops;
+    atomic<bool> stopping{false};
+    atomic<uint64_t> requests{0};
+    atomic<uint64_t> accepted{0};
+
+    static int openListener(uint16_t port, string &err) {
+        int fd = socket(AF_INET6, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        int on = 1, off = 0;
+        if (fd < 0) { err = string("socket: ") + strerror(errno); return -1; }
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+        setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
+        setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off));
+        sockaddr_in6 addr = {};
+        addr.sin6_family = AF_INET6;
+        addr.sin6_addr = in6addr_any;
+        addr.sin6_port = htons(port);
+        if (bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0 || listen(fd, SOMAXCONN) != 0) {
+            err = "port " + to_string(port) + ": " + strerror(errno);
+            close(fd);
+            return -1;
         }
+        return fd;
+    }
+
+    void watch(Loop &lp, Connection &c, uint32_t events) {
+        if (c.events == events) return;
+        epoll_event ev = {};
+        ev.events = events;
+        ev.data.fd = c.fd;
+        epoll_ctl(lp.epollFd, EPOLL_CTL_MOD, c.fd, &ev);
+        c.events = events;
+    }
 
-        // 2) Process all pending demand requests
-        queue<DemandRequest*> temp;
-        while (!demandQ.empty()) {
-            auto *req = demandQ.top();
-            demandQ.pop();
-            bool allocated = false;
+    void drop(Loop &lp, int fd) {
+        epoll_ctl(lp.epollFd, EPOLL_CTL_DEL, fd, nullptr);
+        close(fd);
+        lp.conns.erase(fd);
+    }
+
+    static void reply(Connection &c, string_view s) {
+        if (c.out.empty() || c.out.back().size() + s.size() > kChunk) {
+            c.out.emplace_back(s);
+        } else {
+            c.out.back().append(s);
+        }
+        c.backlog += s.size();
+    }
 
-            // Try allocating request to any available substation
-            for (auto &sub : substations) {
-                if (sub.allocate(req->megawatts)) {
-                    req->state = DemandRequest::ALLOCATED;
-                    allocated = true;
+    // Send as much of the backlog as the socket takes, in one sendmsg per
+    // IOV_MAX chunks; false if the peer is gone
+    bool flush(Loop &lp, Connection &c) {
+        while (!c.out.empty()) {
+            iovec iov[64];
+            size_t n = 0;
+            for (auto it = c.out.begin(); it != c.out.end() && n < 64; ++it, ++n) {
+                size_t skip = n == 0 ? c.outOffset : 0;
+                iov[n].iov_base = const_cast<char*>(it->data() + skip);
+                iov[n].iov_len = it->size() - skip;
+            }
+            msghdr msg = {};
+            msg.msg_iov = iov;
+            msg.msg_iovlen = n;
+            ssize_t sent = sendmsg(c.fd, &msg, MSG_NOSIGNAL);
+            if (sent < 0) {
+                if (errno == EINTR) continue;
+                if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+                return false;
+            }
+            c.backlog -= size_t(sent);
+            size_t left = size_t(sent);
+            while (left > 0) {
+                size_t avail = c.out.front().size() - c.outOffset;
+                if (left < avail) {
+                    c.outOffset += left;
                     break;
                 }
+                left -= avail;
+                c.out.pop_front();
+                c.outOffset = 0;
             }
-            // If not allocated, mark as shed
-            if (!allocated) {
-                req->state = DemandRequest::SHED;
+        }
+        // Wait for room when blocked; stop reading while too far behind
+        uint32_t want = c.backlog > kMaxBacklog ? 0u : uint32_t(EPOLLIN);
+        if (!c.out.empty()) want |= EPOLLOUT;
+        watch(lp, c, want | EPOLLRDHUP);
+        return true;
+    }
+
+    void flushBatch(Loop &lp) {
+        if (lp.batch.empty()) return;
+        grid.receiveDemands(lp.batch.data(), lp.batch.size());
+        lp.lastSeq = max(lp.lastSeq, lp.batch.back().seq);
+        lp.pushed = true;
+        lp.batch.clear();
+    }
+
+    // With a journal, make this wakeup's reports durable before their "ok"
+    // goes out: drain them through the journal under 'control' (waiting out
+    // any producer still between taking a sequence and pushing), then wait
+    // for the group commit outside the lock. False if the journal failed.
+    bool commitReports(Loop &lp) {
+        if (!lp.pushed || !grid.journaling()) return true;
+        lp.pushed = false;
+        for (;;) {
+            {
+                lock_guard<mutex> lk(control);
+                grid.drainIntake();
+                if (grid.drainedThrough(lp.lastSeq)) break;
             }
-            temp.push(req);
+            this_thread::yield();
         }
+        string err;
+        if (grid.syncJournal(err)) return true;
+        cerr << "Journal failed, dropping unconfirmed clients: " << err << "\n";
+        return false;
+    }
 
-        // 3) Re-enqueue only those still in QUEUED state
-        while (!temp.empty()) {
-            auto *r = temp.front();
-            temp.pop();
-            if (r->state == DemandRequest::QUEUED)
-                demandQ.push(r);
+    // Handle every complete line in c.in. Reports are gathered in lp.batch;
+    // anything that reads or changes controller state first pushes that batch
+    // so it sees earlier reports, then takes 'control' once for the wakeup.
+    void serve(Loop &lp, Connection &c, unique_lock<mutex> &held) {
+        size_t begin = 0;
+        string_view all(c.in);
+        for (size_t nl; (nl = all.find('\n', begin)) != string_view::npos; begin = nl + 1) {
+            string_view line = all.substr(begin, nl - begin), cmd, a, b, m;
+            if (!nextToken(line, cmd)) continue;
+            requests.fetch_add(1, memory_order_relaxed);
+            if (cmd == "report") {
+                double mw;
+                uint16_t zone = 0;
+                string_view z;
+                const DemandClassInfo *cls;
+                if (nextToken(line, a) && nextToken(line, b) && nextToken(line, m)
+                    && (cls = findDemandClass(b)) && parseNumber(m, mw) && mw > 0
+                    && (!nextToken(line, z) || parseNumber(z, zone))) {
+                    if (zone >= zones) {
+                        reply(c, "err unknown zone\n");
+                        continue;
+                    }
+                    lp.batch.push_back({mw, grid.nowNanos(), 0, grid.consumerId(a), zone, cls->make});
+                    reply(c, "ok\n");
+                    c.reported = true;
+                } else {
+                    reply(c, "err usage: report <consumerID> <res|com|ind> <MW> [zone]\n");
+                }
+            } else if (cmd == "release" || cmd == "status") {
+                flushBatch(lp);
+                if (!held.owns_lock()) held = unique_lock<mutex>(control);
+                if (cmd == "status") {
+                    ostringstream os;
+                    grid.showSummary(os);
+                    os << ".\n";
+                    string text = os.str();
+                    c.backlog += text.size();
+                    c.out.push_back(move(text));
+                } else if (nextToken(line, a)) {
+                    double mw;
+                    size_t n = grid.releaseDemand(a, mw);
+                    char buf[64];
+                    snprintf(buf, sizeof(buf), "released %zu %g\n", n, mw);
+                    reply(c, buf);
+                } else {
+                    reply(c, "err usage: release <consumerID>\n");
+                }
+            } else {
+                reply(c, "err unknown command\n");
+            }
         }
+        c.in.erase(0, begin);
     }
 
-    // Display current grid status: substations, demands, maintenance
-    void showStatus() const {
-        cout << "--- Grid Status ---\n";
+    void accept(Loop &lp) {
+        while (true) {
+            int fd = accept4(lp.listenFd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (fd < 0) return;   // EAGAIN, or out of descriptors until a peer leaves
+            int on = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+            unique_ptr<Connection> c(new Connection());
+            c->fd = fd;
+            c->events = EPOLLIN | EPOLLRDHUP;
+            epoll_event ev = {};
+            ev.events = c->events;
+            ev.data.fd = fd;
+            epoll_ctl(lp.epollFd, EPOLL_CTL_ADD, fd, &ev);
+            lp.conns.emplace(fd, move(c));
+            accepted.fetch_add(1, memory_order_relaxed);
+        }
+    }
 
-        cout << "Substations:" << "\n";
-        for (auto &s : substations) {
-            cout << "  " << s.id << ": " << s.usedMW << "/" << s.capacityMW
-                 << (s.online ? " MW (ONLINE)" : " MW (OFFLINE)") << "\n";
+    void run(Loop &lp) {
+        epoll_event events[kMaxEvents];
+        vector<char> buf(kReadChunk);
+        while (!stopping.load(memory_order_relaxed)) {
+            int n = epoll_wait(lp.epollFd, events, kMaxEvents, -1);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                return;
+            }
+            unique_lock<mutex> held(control, defer_lock);
+            for (int i = 0; i < n; ++i) {
+                int fd = events[i].data.fd;
+                if (fd == lp.wakeFd) return;
+                if (fd == lp.listenFd) { accept(lp); continue; }
+                auto it = lp.conns.find(fd);
+                if (it == lp.conns.end()) continue;
+                Connection &c = *it->second;
+                bool gone = (events[i].events & (EPOLLERR | EPOLLHUP)) != 0;
+                if (!gone && (events[i].events & (EPOLLIN | EPOLLRDHUP))) {
+                    // One read per wakeup keeps a busy peer from starving the rest
+                    ssize_t got = read(fd, buf.data(), buf.size());
+                    if (got > 0) {
+                        c.in.append(buf.data(), size_t(got));
+                        serve(lp, c, held);
+                        if (c.in.size() > kMaxLine) gone = true;
+                    } else if (got == 0 || (errno != EAGAIN && errno != EINTR)) {
+                        gone = c.out.empty();   // Half-close: still answer what was asked
+                        if (!gone) watch(lp, c, EPOLLOUT);
+                    }
+                }
+                if (gone) { drop(lp, fd); continue; }
+                if (!c.out.empty()) lp.dirty.push_back(&c);
+                else if (events[i].events & EPOLLOUT) watch(lp, c, EPOLLIN | EPOLLRDHUP);
+            }
+            if (held.owns_lock()) held.unlock();
+            flushBatch(lp);
+            bool durable = commitReports(lp);
+            for (Connection *c : lp.dirty) {
+                int fd = c->fd;
+                bool closing = !(c->events & EPOLLIN) && c->backlog <= kMaxBacklog;
+                bool unconfirmed = c->reported && !durable;
+                c->reported = false;
+                if (unconfirmed || !flush(lp, *c) || (closing && c->out.empty())) drop(lp, fd);
+            }
+            lp.dirty.clear();
         }
+    }
+
+public:
+    DemandServer(GridController &g, mutex &controlMutex) : grid(g), control(controlMutex) {}
+    DemandServer(const DemandServer &) = delete;
+    DemandServer &operator=(const DemandServer &) = delete;
 
-        cout << "Pending Demands:" << "\n";
-        auto copyQ = demandQ;  // Copy to iterate without modifying
-        while (!copyQ.empty()) {
-            auto *r = copyQ.top();
-            copyQ.pop();
-            cout << "  " << r->consumerID << " (" << r->megawatts
-                 << "MW, pr=" << r->priority() << ")\n";
+    // Listen on 'port' (0 = any free port) with 'loopCount' event loops; false
+    // with 'err' set if the port cannot be bound
+    bool start(uint16_t port, size_t loopCount, string &err) {
+        {
+            // A report for an unknown zone would create regions up to it
+            lock_guard<mutex> lk(control);
+            zones = grid.regionCount();
         }
+        for (size_t i = 0; i < max<size_t>(1, loopCount); ++i) {
+            unique_ptr<Loop> lp(new Loop());
+            lp->listenFd = openListener(port, err);
+            if (lp->listenFd < 0) { stop(); return false; }
+            if (port == 0) {
+                // Later listeners join the port the first one was given
+                sockaddr_in6 addr = {};
+                socklen_t len = sizeof(addr);
+                getsockname(lp->listenFd, reinterpret_cast<sockaddr*>(&addr), &len);
+                port = ntohs(addr.sin6_port);
+            }
+            lp->epollFd = epoll_create1(EPOLL_CLOEXEC);
+            lp->wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+            epoll_event ev = {};
+            ev.events = EPOLLIN;
+            ev.data.fd = lp->listenFd;
+            epoll_ctl(lp->epollFd, EPOLL_CTL_ADD, lp->listenFd, &ev);
+            ev.data.fd = lp->wakeFd;
+            epoll_ctl(lp->epollFd, EPOLL_CTL_ADD, lp->wakeFd, &ev);
+            loops.push_back(move(lp));
+        }
+        boundPort = port;
+        for (auto &lp : loops) {
+            Loop *l = lp.get();
+            l->worker = thread([this, l] { run(*l); });
+        }
+        return true;
+    }
 
-        cout << "Maintenance Jobs:" << "\n";
-        for (auto &m : maintenanceList) {
-            cout << "  " << m.substationID << " [" << m.state << "]\n";
+    // Stop all loops and close every socket; idempotent
+    void stop() {
+        stopping.store(true, memory_order_relaxed);
+        for (auto &lp : loops) {
+            uint64_t one = 1;
+            if (lp->wakeFd >= 0 && write(lp->wakeFd, &one, sizeof(one)) < 0) {}
+            if (lp->worker.joinable()) lp->worker.join();
+            for (auto &c : lp->conns) close(c.first);
+            lp->conns.clear();
+            for (int fd : {lp->listenFd, lp->epollFd, lp->wakeFd})
+                if (fd >= 0) close(fd);
         }
+        loops.clear();
     }
+
+    ~DemandServer() { stop(); }
+
+    uint16_t port() const { return boundPort; }
+    size_t loopCount() const { return loops.size(); }
+    uint64_t requestCount() const { return requests.load(memory_order_relaxed); }
+    uint64_t connectionCount() const { return accepted.load(memory_order_relaxed); }
 };
 
 //----------- main.cpp -----------
-int main() {
-    GridController grid;
-    // Initialize some example substations
-    grid.addSubstation("S01", 50.0);
-    grid.addSubstation("S02", 40.0);
-    grid.addSubstation("S03", 60.0);
+int main(int argc, char **argv) {
+    // Command-line options
+    QueueBackend backend = QueueBackend::HEAP;
+    const char *ingestPath = nullptr;
+    const char *replayPath = nullptr;
+    const char *recordIn = nullptr, *recordOut = nullptr;
+    const char *restorePath = nullptr;
+    const char *journalPath = nullptr;
+    const char *simulatePath = nullptr;
+    const char *topologyPath = nullptr, *topologyCache = nullptr;
+    time_t simTick = 0;
+    bool monteCarlo = false;
+    ScenarioConfig scenarioCfg;
+    bool bench = false;
+    BenchConfig benchCfg;
+    size_t threads = 0;
+    size_t autoMs = 0, autoDepth = 0;   // Background ticks; 0 ms = manual 'balance' only
+    long servePort = -1;                // TCP port for DemandServer; -1 = stdin only
+    size_t serveLoops = 0;              // Event loops (0 = one per core)
+    for (int i = 1; i < argc; ++i) {
+        string arg = argv[i];
+        if (arg == "--queue" && i + 1 < argc) {
+            string name = argv[++i];
+            if (name == "heap") backend = QueueBackend::HEAP;
+            else if (name == "bucket") backend = QueueBackend::BUCKET;
+            else { cerr << "Unknown queue backend: " << name << "\n"; return 1; }
+        } else if (arg == "--ingest" && i + 1 < argc) {
+            ingestPath = argv[++i];
+        } else if (arg == "--replay" && i + 1 < argc) {
+            replayPath = argv[++i];
+        } else if (arg == "--restore" && i + 1 < argc) {
+            restorePath = argv[++i];
+        } else if (arg == "--journal" && i + 1 < argc) {
+            journalPath = argv[++i];
+        } else if (arg == "--record" && i + 2 < argc) {
+            recordIn = argv[++i];
+            recordOut = argv[++i];
+        } else if (arg == "--threads" && i + 1 < argc) {
+            if (!parseNumber(string_view(argv[++i]), threads) || threads == 0) {
+                cerr << "Bad thread count: " << argv[i] << "\n";
+                return 1;
+            }
+        } else if (arg == "--auto" && i + 1 < argc) {
+            if (!parseNumber(string_view(argv[++i]), autoMs) || autoMs == 0) {
+                cerr << "Bad tick interval: " << argv[i] << "\n";
+                return 1;
+            }
+        } else if (arg == "--auto-depth" && i + 1 < argc) {
+            if (!parseNumber(string_view(argv[++i]), autoDepth)) {
+                cerr << "Bad queue depth: " << argv[i] << "\n";
+                return 1;
+            }
+        } else if (arg == "--topology" && i + 1 < argc) {
+            topologyPath = argv[++i];
+        } else if (arg == "--topology-cache" && i + 1 < argc) {
+            topologyCache = argv[++i];
+        } else if (arg == "--simulate" && i + 1 < argc) {
+            simulatePath = argv[++i];
+        } else if (arg == "--sim-tick" && i + 1 < argc) {
+            if (!parseSimTime(string_view(argv[++i]), simTick)) {
+                cerr << "Bad simulation tick: " << argv[i] << "\n";
+                return 1;
+            }
+        } else if (arg == "--montecarlo") {
+            monteCarlo = true;
+            string err;
+            if (i + 1 < argc && argv[i + 1][0] != '-' && !scenarioCfg.parse(argv[++i], err)) {
+                cerr << "Bad scenario spec: " << err << "\n";
+                return 1;
+            }
+        } else if (arg == "--serve" && i + 1 < argc) {
+            if (!parseNumber(string_view(argv[++i]), servePort) || servePort < 0 || servePort > 65535) {
+                cerr << "Bad port: " << argv[i] << "\n";
+                return 1;
+            }
+        } else if (arg == "--serve-loops" && i + 1 < argc) {
+            if (!parseNumber(string_view(argv[++i]), serveLoops) || serveLoops == 0) {
+                cerr << "Bad loop count: " << argv[i] << "\n";
+                return 1;
+            }
+        } else if (arg == "--bench") {
+            bench = true;
+            string err;
+            if (i + 1 < argc && argv[i + 1][0] != '-' && !benchCfg.parse(argv[++i], err)) {
+                cerr << "Bad benchmark spec: " << err << "\n";
+                return 1;
+            }
+        } else {
+            cerr << "Usage: " << argv[0] << " [--queue heap|bucket] [--ingest <file|->]"
+                 << " [--replay <log>] [--record <text|-> <log>] [--restore <snapshot>]"
+                 << " [--topology <csv>] [--topology-cache <file>]"
+                 << " [--journal <file>] [--auto <ms>] [--auto-depth <n>]"
+                 << " [--serve <port>] [--serve-loops <n>]"
+                 << " [--simulate <script>] [--sim-tick <time>] [--montecarlo [key=value,...]]"
+                 << " [--bench [key=value,...]]"
+                 << " [--threads N]\n";
+            return 1;
+        }
+    }
+
+    if (bench) {
+        if (threads && !benchCfg.threads) benchCfg.threads = threads;
+        runBenchmark(benchCfg, backend);
+        return 0;
+    }
+
+    GridController grid(backend);
+    if (threads) grid.setWorkerThreads(threads);
+    if (restorePath) {
+        // Resume from a snapshot instead of the example grid
+        auto t0 = chrono::steady_clock::now();
+        string err;
+        if (!grid.loadSnapshot(restorePath, err)) {
+            cerr << "Cannot restore " << restorePath << ": " << err << "\n";
+            return 1;
+        }
+        double secs = chrono::duration<double>(chrono::steady_clock::now() - t0).count();
+        fprintf(stderr, "Restored %s in %.3f s: %zu pending demands, %zu KiB\n",
+                restorePath, secs, grid.pendingCount(), grid.memoryUsage() / 1024);
+    } else if (topologyPath) {
+        auto t0 = chrono::steady_clock::now();
+        GridTopology topo;
+        bool cached;
+        string err, cacheErr;
+        if (!loadTopology(topologyPath, topologyCache, topo, cached, err, cacheErr)) {
+            cerr << "Cannot load topology " << topologyPath << ": " << err << "\n";
+            return 1;
+        }
+        if (!grid.addTopology(topo)) {
+            cerr << "Cannot load topology " << topologyPath << ": duplicate substation id\n";
+            return 1;
+        }
+        if (!cacheErr.empty())
+            cerr << "Cannot write topology cache: " << cacheErr << "\n";
+        double secs = chrono::duration<double>(chrono::steady_clock::now() - t0).count();
+        fprintf(stderr, "Loaded %zu substations from %s in %.3f s\n",
+                topo.size(), cached ? topologyCache : topologyPath, secs);
+    } else {
+        // Initialize some example substations
+        grid.addSubstation("S01", 50.0);
+        grid.addSubstation("S02", 40.0);
+        grid.addSubstation("S03", 60.0);
+    }
+    if (journalPath) {
+        // Catch up on events after the snapshot, then keep journaling
+        auto t0 = chrono::steady_clock::now();
+        string err;
+        long long n = grid.replayJournal(journalPath, err);
+        if (n < 0 || !grid.openJournal(journalPath, err)) {
+            cerr << "Cannot use journal " << journalPath << ": " << err << "\n";
+            return 1;
+        }
+        double secs = chrono::duration<double>(chrono::steady_clock::now() - t0).count();
+        if (n > 0)
+            fprintf(stderr, "Replayed %lld journal records in %.3f s\n", n, secs);
+    }
+
+    // Convert text reports into the binary demand log format
+    if (recordIn) {
+        int fd = strcmp(recordIn, "-") == 0 ? STDIN_FILENO : open(recordIn, O_RDONLY);
+        uint64_t written = 0;
+        if (fd < 0 || !convertToDemandLog(fd, recordOut, written)) {
+            cerr << "Cannot convert " << recordIn << " to " << recordOut << "\n";
+            return 1;
+        }
+        printf("Wrote %llu demand records to %s\n", (unsigned long long)written, recordOut);
+        return 0;
+    }
+
+    // Replay a binary demand log into the controller
+    if (replayPath) {
+        auto t0 = chrono::steady_clock::now();
+        string err;
+        uint64_t rejected;
+        long long n = replayDemandLog(grid, replayPath, rejected, err);
+        double secs = chrono::duration<double>(chrono::steady_clock::now() - t0).count();
+        if (n < 0) {
+            cerr << "Cannot replay " << replayPath << ": " << err << "\n";
+            return 1;
+        }
+        printf("Replayed %lld demand records in %.3f s (%.0f records/s)\n",
+               n, secs, secs > 0 ? n / secs : 0.0);
+        if (rejected)
+            printf("  skipped %llu invalid records\n", (unsigned long long)rejected);
+        printf("  pending demands: %zu  memory: %zu KiB\n",
+               grid.pendingCount(), grid.memoryUsage() / 1024);
+        return 0;
+    }
+
+    // Simulation: play a timed script on a virtual clock as fast as it computes
+    if (simulatePath) {
+        int fd = strcmp(simulatePath, "-") == 0 ? STDIN_FILENO : open(simulatePath, O_RDONLY);
+        if (fd < 0) {
+            cerr << "Cannot open " << simulatePath << ": " << strerror(errno) << "\n";
+            return 1;
+        }
+        size_t malformed;
+        vector<SimEvent> events = parseSimulationScript(fd, malformed);
+        if (fd != STDIN_FILENO) close(fd);
+        SimulationConfig cfg;
+        cfg.start = time(nullptr);     // Lines up with maintenance in a restored snapshot
+        cfg.tick = simTick;
+        VirtualClock clock(cfg.start);
+        grid.setClock(clock);
+        auto t0 = chrono::steady_clock::now();
+        SimulationStats st = runSimulation(grid, clock, events, cfg);
+        double secs = chrono::duration<double>(chrono::steady_clock::now() - t0).count();
+        const SchedulerMetrics &m = grid.schedulerMetrics();
+        printf("Simulated %lld s of grid time in %.3f s: %zu events, %zu ticks\n",
+               (long long)st.elapsed, secs, st.events, st.ticks);
+        printf("  placed: %llu  shed: %llu (%.1f MW)  migrated: %llu  migration shed: %llu\n",
+               (unsigned long long)SchedulerMetrics::get(m.placed),
+               (unsigned long long)SchedulerMetrics::get(m.shed), m.shedMW.load(),
+               (unsigned long long)SchedulerMetrics::get(m.migrated),
+               (unsigned long long)SchedulerMetrics::get(m.migrationShed));
+        printf("  rejected: %zu malformed, %zu unknown substation or zone\n", malformed, st.rejected);
+        grid.showSummary(cout);
+        return 0;
+    }
+
+    // Monte Carlo: random scenarios on copies of the grid built so far
+    if (monteCarlo) {
+        vector<SimEvent> base;
+        if (!scenarioCfg.script.empty()) {
+            int fd = open(scenarioCfg.script.c_str(), O_RDONLY);
+            if (fd < 0) {
+                cerr << "Cannot open " << scenarioCfg.script << ": " << strerror(errno) << "\n";
+                return 1;
+            }
+            size_t malformed;
+            base = parseSimulationScript(fd, malformed);
+            close(fd);
+            if (malformed) fprintf(stderr, "Skipped %zu malformed script lines\n", malformed);
+        }
+        GridTopology topo = grid.topology();
+        scenarioCfg.splitMinMW = grid.splitMinChunk();
+        scenarioCfg.retryHorizon = grid.retryTicks();
+        scenarioCfg.agingStep = grid.retryAgingStep();
+        scenarioCfg.batchPacking = grid.batchPackingEnabled();
+        size_t lanes = scenarioCfg.threads ? scenarioCfg.threads
+                                           : max(1u, thread::hardware_concurrency());
+        auto t0 = chrono::steady_clock::now();
+        ScenarioSamples samples = runScenarios(topo, base, scenarioCfg, backend, lanes);
+        double secs = chrono::duration<double>(chrono::steady_clock::now() - t0).count();
+        printf("Ran %zu scenarios of %lld s on %zu substations in %.3f s (%zu lanes, %.0f scenarios/s)\n",
+               scenarioCfg.runs, (long long)scenarioCfg.horizon, topo.size(), secs, lanes,
+               secs > 0 ? scenarioCfg.runs / secs : 0.0);
+        printScenarioReport(samples, topo, scenarioCfg);
+        return 0;
+    }
+
+    // Batch mode: stream records from a file or stdin and print only a summary
+    if (ingestPath) {
+        int fd = strcmp(ingestPath, "-") == 0 ? STDIN_FILENO : open(ingestPath, O_RDONLY);
+        if (fd < 0) {
+            cerr << "Cannot open " << ingestPath << ": " << strerror(errno) << "\n";
+            return 1;
+        }
+        auto t0 = chrono::steady_clock::now();
+        IngestStats st = ingestStream(grid, fd);
+        double secs = chrono::duration<double>(chrono::steady_clock::now() - t0).count();
+        if (fd != STDIN_FILENO) close(fd);
+        printf("Ingested %zu records in %.3f s (%.0f records/s)\n",
+               st.lines, secs, secs > 0 ? st.lines / secs : 0.0);
+        printf("  reports: %zu  maintenance: %zu  releases: %zu  balances: %zu  rejected: %zu\n",
+               st.reports, st.maintenance, st.releases, st.balances, st.rejected);
+        printf("  pending demands: %zu  memory: %zu KiB\n",
+               grid.pendingCount(), grid.memoryUsage() / 1024);
+        return 0;
+    }
 
     // Welcome banner and usage instructions
     cout << "Smart Grid CLI — Demand-Response Coordinator\n";
     cout << "Enter commands to manage grid.\n";
     cout << "Type 'help' for detailed syntax and examples.\n\n";
 
+    // Commands and background ticks take turns on the controller
+    mutex gridMutex;
+    unique_ptr<BackgroundScheduler> autoTick;
+    if (autoMs)
+        autoTick.reset(new BackgroundScheduler(grid, gridMutex, chrono::milliseconds(autoMs), autoDepth));
+    DemandServer server(grid, gridMutex);
+    if (servePort >= 0) {
+        string err;
+        size_t loopCount = serveLoops ? serveLoops : max(1u, thread::hardware_concurrency());
+        if (!server.start(uint16_t(servePort), loopCount, err)) {
+            cerr << "Cannot serve: " << err << "\n";
+            return 1;
+        }
+        fprintf(stderr, "Serving on port %u with %zu event loops\n", unsigned(server.port()),
+                server.loopCount());
+    }
+
     string line;
     while (true) {
         cout << "> ";
@@ -223,27 +4973,60 @@ int main() {
         istringstream iss(line);
         string cmd;
         iss >> cmd;
+        unique_lock<mutex> lk(gridMutex);
 
         if (cmd == "exit") {
             cout << "Exiting Smart Grid CLI. Goodbye!\n";
             break;
         }
+        else if (cmd == "snapshot") {
+            // Capture state now; the file is written in the background
+            string path, err;
+            if (!(iss >> path)) {
+                cout << "Usage: snapshot <file>\n";
+                continue;
+            }
+            if (!grid.saveSnapshot(path, err))
+                cout << "Previous snapshot failed (" << err << "); nothing saved, try again.\n";
+            else
+                cout << "Snapshot of grid state is being written to " << path << ".\n";
+        }
         else if (cmd == "help") {
             // Expanded help with formats and examples
             cout << "Available commands:\n";
-            cout << "  report <consumerID> <res|com|ind> <MW>   "
+            cout << "  report <consumerID> <res|com|ind> <MW> [zone]   "
                  << "-- Submit a demand request.\n";
             cout << "       e.g.: report C101 res 25.5\n";
-            cout << "  balance                               "
+            cout << "  balance [first|best|worst|scan-first|scan-best] [incremental|full] [batch]   "
                  << "-- Run scheduling: allocate or shed load.\n";
-            cout << "       e.g.: balance\n";
+            cout << "       e.g.: balance best full   "
+                 << "(defaults: first, incremental)\n";
             cout << "  maintenance <subID> <delaySec>        "
                  << "-- Schedule 1h maintenance after delay.\n";
             cout << "       e.g.: maintenance S02 300   "
                  << "(start in 5 min, lasts 1h)\n";
-            cout << "  status                                "
+            cout << "  split <minChunkMW>|off                "
+                 << "-- Let large demands span substations.\n";
+            cout << "       e.g.: split 5\n";
+            cout << "  retry <ticks> [agingStep]|off         "
+                 << "-- Hold unplaced demands before shedding.\n";
+            cout << "       e.g.: retry 3 1\n";
+            cout << "  release <consumerID>                  "
+                 << "-- Complete a consumer's allocated demand.\n";
+            cout << "       e.g.: release C101\n";
+            cout << "  snapshot <file>                       "
+                 << "-- Save state for --restore (written in background).\n";
+            cout << "       e.g.: snapshot grid.snap\n";
+            cout << "  status [summary | top <K> [page]]     "
                  << "-- Show grid, demands, maintenance.\n";
-            cout << "       e.g.: status\n";
+            cout << "       e.g.: status top 20 1   "
+                 << "(second page of 20 pending demands)\n";
+            cout << "  auto <ms> [depth <n>] [policy] | off  "
+                 << "-- Balance in the background on a timer.\n";
+            cout << "       e.g.: auto 500 depth 10000\n";
+            cout << "  metrics [prom [file]]                 "
+                 << "-- Scheduler counters, phase times, utilization.\n";
+            cout << "       e.g.: metrics prom /var/lib/node_exporter/grid.prom\n";
             cout << "  help                                  "
                  << "-- Show this help message.\n";
             cout << "  exit                                  "
@@ -253,25 +5036,57 @@ int main() {
             // Prompt format if insufficient args
             string cid, type;
             double mw;
-            if (!(iss >> cid >> type >> mw)) {
-                cout << "Usage: report <consumerID> <res|com|ind> <MW>\n";
+            unsigned zone = 0;
+            if (!(iss >> cid >> type >> mw) || (!(iss >> zone) && !iss.eof())) {
+                cout << "Usage: report <consumerID> <res|com|ind> <MW> [zone]\n";
                 continue;
             }
-            DemandRequest *d = nullptr;
-            if (type == "res") d = new ResidentialRequest(cid, mw);
-            else if (type == "com") d = new CommercialRequest(cid, mw);
-            else if (type == "ind") d = new IndustrialRequest(cid, mw);
-            if (d) {
-                grid.receiveDemand(d);
-                cout << "Demand recorded for " << cid << ".\n";
-            } else {
+            if (zone >= grid.regionCount()) {
+                cout << "Unknown zone " << zone << ".\n";
+                continue;
+            }
+            if (!(mw > 0)) {
+                cout << "Demand must be a positive number of MW.\n";
+                continue;
+            }
+            const DemandClassInfo *cls = findDemandClass(type);
+            if (!cls) {
                 cout << "Invalid type. Use 'res', 'com', or 'ind'.\n";
+                continue;
             }
+            cls->submit(grid, grid.consumerId(cid), mw, grid.nowNanos(), uint16_t(zone));
+            cout << "Demand recorded for " << cid << ".\n";
         }
         else if (cmd == "balance") {
-            // Run the scheduler logic
-            grid.runScheduler();
+            // Run the scheduler logic with an optional allocation policy
+            string name;
+            AllocPolicy policy = AllocPolicy::FIRST_FIT;
+            BalanceMode mode = BalanceMode::INCREMENTAL;
+            bool batch = false;
+            bool ok = true;
+            while (ok && iss >> name) {
+                if (name == "batch") batch = true;
+                else if (name == "full") mode = BalanceMode::FULL;
+                else if (name == "incremental") mode = BalanceMode::INCREMENTAL;
+                else ok = parseAllocPolicy(name, policy);
+            }
+            if (!ok) {
+                cout << "Usage: balance [first|best|worst|scan-first|scan-best] [incremental|full] [batch]\n";
+                continue;
+            }
+            // 'batch' applies to this tick only; later and background ticks keep their packing
+            bool wasBatch = grid.batchPackingEnabled();
+            grid.setBatchPacking(batch);
+            grid.runScheduler(policy, mode);
+            grid.setBatchPacking(wasBatch);
             cout << "Load balancing complete.\n";
+            const TickDelta &d = grid.lastTickDelta();
+            if (d.deferred)
+                cout << "Deferred " << d.deferred << " demands (" << d.deferredMW
+                     << " MW) for retry.\n";
+            if (d.migrated || d.migrationShed)
+                cout << "Maintenance moved " << d.migrated << " demands (" << d.migratedMW
+                     << " MW); shed " << d.migrationShed << " (" << d.migrationShedMW << " MW).\n";
         }
         else if (cmd == "maintenance") {
             string sid;
@@ -280,14 +5095,120 @@ int main() {
                 cout << "Usage: maintenance <subID> <delaySec>\n";
                 continue;
             }
-            time_t now = time(nullptr);
-            grid.scheduleMaintenance(sid, now + delaySec, now + delaySec + 3600);
+            time_t now = grid.now();
+            if (!grid.scheduleMaintenance(sid, now + delaySec, now + delaySec + 3600)) {
+                cout << "Unknown substation " << sid << ".\n";
+                continue;
+            }
             cout << "Maintenance scheduled for " << sid
                  << " starting in " << delaySec << " seconds.\n";
         }
+        else if (cmd == "split") {
+            string arg;
+            double minChunk = 0;
+            if (!(iss >> arg) || (arg != "off" && !(istringstream(arg) >> minChunk && minChunk > 0))) {
+                cout << "Usage: split <minChunkMW>|off\n";
+                continue;
+            }
+            grid.setSplitAllocation(arg == "off" ? 0 : minChunk);
+            if (arg == "off") cout << "Split allocation disabled.\n";
+            else cout << "Split allocation enabled, minimum share " << minChunk << " MW.\n";
+        }
+        else if (cmd == "retry") {
+            string arg;
+            unsigned ticks = 0, step = 1;
+            if (!(iss >> arg) || (arg != "off" && !(istringstream(arg) >> ticks && ticks > 0 && ticks <= 255))
+                || (arg != "off" && (iss >> step) && step > 255)) {
+                cout << "Usage: retry <ticks> [agingStep]|off\n";
+                continue;
+            }
+            grid.setRetryHorizon(arg == "off" ? 0 : ticks, step);
+            if (arg == "off") cout << "Retry horizon disabled; unplaced demands are shed.\n";
+            else cout << "Unplaced demands wait up to " << ticks << " ticks, gaining "
+                      << step << " priority per tick.\n";
+        }
+        else if (cmd == "release") {
+            string cid;
+            if (!(iss >> cid)) {
+                cout << "Usage: release <consumerID>\n";
+                continue;
+            }
+            double mw;
+            if (grid.releaseDemand(cid, mw) == 0)
+                cout << "No allocated demand for " << cid << ".\n";
+            else
+                cout << "Released " << mw << " MW for " << cid << ".\n";
+        }
+        else if (cmd == "auto") {
+            // Start, replace or stop background ticks
+            string arg;
+            if (!(iss >> arg)) {
+                if (autoTick)
+                    cout << "Auto balance every " << autoTick->interval().count() << " ms"
+                         << (autoTick->depthThreshold() ? " or at " + to_string(autoTick->depthThreshold())
+                             + " pending" : string()) << "; " << autoTick->tickCount() << " ticks so far.\n";
+                else
+                    cout << "Auto balance is off.\n";
+                continue;
+            }
+            size_t ms = 0, depth = 0;
+            AllocPolicy policy = AllocPolicy::FIRST_FIT;
+            BalanceMode mode = BalanceMode::INCREMENTAL;
+            bool ok = arg == "off" || (parseNumber(string_view(arg), ms) && ms > 0);
+            for (string tok; ok && iss >> tok; ) {
+                if (tok == "depth") ok = bool(iss >> depth);
+                else if (tok == "full") mode = BalanceMode::FULL;
+                else if (tok == "incremental") mode = BalanceMode::INCREMENTAL;
+                else ok = parseAllocPolicy(tok, policy);
+            }
+            if (!ok || (arg == "off" && (depth || mode == BalanceMode::FULL))) {
+                cout << "Usage: auto <ms> [depth <n>] [first|best|worst|scan-first|scan-best]"
+                     << " [incremental|full] | auto off\n";
+                continue;
+            }
+            // The worker needs the controller to finish its last tick
+            lk.unlock();
+            autoTick.reset();
+            if (ms)
+                autoTick.reset(new BackgroundScheduler(grid, gridMutex, chrono::milliseconds(ms),
+                                                       depth, policy, mode));
+            if (ms)
+                cout << "Auto balance every " << ms << " ms"
+                     << (depth ? " or at " + to_string(depth) + " pending" : string()) << ".\n";
+            else
+                cout << "Auto balance off.\n";
+        }
+        else if (cmd == "metrics") {
+            // Scheduler counters and timings; 'prom' switches to Prometheus text
+            string format, path;
+            iss >> format >> path;
+            if (format.empty()) {
+                grid.showMetrics();
+            } else if (format == "prom" && path.empty()) {
+                grid.writePrometheus(cout);
+            } else if (format == "prom") {
+                ofstream out(path);
+                grid.writePrometheus(out);
+                out.close();
+                if (out) cout << "Metrics written to " << path << ".\n";
+                else cout << "Cannot write " << path << ".\n";
+            } else {
+                cout << "Usage: metrics [prom [file]]\n";
+            }
+        }
         else if (cmd == "status") {
-            // Display current state of the grid
-            grid.showStatus();
+            // Display current state of the grid: everything, totals, or one page of the queue
+            string view;
+            size_t k = 0, page = 0;
+            if (!(iss >> view)) {
+                grid.showStatus();
+            } else if (view == "summary") {
+                grid.showSummary();
+            } else if (view == "top" && iss >> k && k > 0 && (!(iss >> page) || page < SIZE_MAX / k - 1)) {
+                grid.showTopPending(k, page);
+            } else {
+                cout << "Usage: status [summary | top <K> [page]]\n";
+            }
         }
         else if (cmd.empty()) {
             continue;  // ignore empty lines
@@ -296,5 +5217,12 @@ int main() {
             cout << "Unknown command. Type 'help' for list of commands.\n";
         }
     }
+    server.stop();
+    autoTick.reset();
+    string err;
+    if (!grid.finishSnapshot(err)) {
+        cerr << "Snapshot failed: " << err << "\n";
+        return 1;
+    }
     return 0;
 }
@@ -0,0 +1,22 @@
+#!/bin/sh
+# Snapshot + journal restore must reproduce a split-dependent allocation.
+# Usage: tests/restore_split.sh [path-to-smartGrid-binary]
+set -e
+BIN=${1:-./smartGrid}
+case $BIN in /*) ;; *) BIN=$(pwd)/$BIN ;; esac
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+cd "$DIR"
+
+printf 'split 5\nsnapshot snap\nreport C9 ind 70\nbalance\nstatus\nexit\n' \
+    | "$BIN" --journal j > live.txt
+printf 'status\nexit\n' | "$BIN" --restore snap --journal j > restored.txt
+
+sed -n '/Grid Status/,/^$/p' live.txt > a
+sed -n '/Grid Status/,/^$/p' restored.txt > b
+[ -s a ] || { echo "FAIL: no status output"; exit 1; }
+if ! diff a b; then
+    echo "FAIL: restored status differs from live run"
+    exit 1
+fi
+echo "PASS"